@@ -0,0 +1,361 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/* Micro benchmarks : synthetic guest loops, one per instruction class, run
+   from a generated 64K system ROM, and "post" : libxtem_init(), the bundled
+   bios64 until its first unimplemented opcode, expected at POST_PC some 500
+   instructions into the POST, and libxtem_cleanup(). That one mostly
+   measures setting an instance up and tearing it down, not emulation speed.
+   A check of the PIT count read back runs first.
+   Prints a table on stderr and writes one JSON object per benchmark (one per
+   line) to the results file, with whichever core libxtem was built with.
+   usage : xtem_bench [scale [results]] */
+
+#include "libxtem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROM_SIZE 0x10000
+#define INSNS 20000000 // per micro benchmark, times scale
+#define POSTS 100      // times scale
+#define POST_PC 0xfe0e7
+
+typedef struct
+{
+  const char* name;
+  const char* desc;
+  const uint8_t* body; // loop body, jumped back to forever
+  size_t len;
+} prog_t;
+
+/* DS = ES = SS = 0x1000, SP = 0xF000, BX = 0x100, SI = 0x10, BP = 0x400,
+   DF clear, IF clear */
+static const uint8_t prologue[] = {
+  0xb8, 0x00, 0x10, // mov ax,0x1000
+  0x8e, 0xd8,       // mov ds,ax
+  0x8e, 0xc0,       // mov es,ax
+  0x8e, 0xd0,       // mov ss,ax
+  0xbc, 0x00, 0xf0, // mov sp,0xf000
+  0xbb, 0x00, 0x01, // mov bx,0x100
+  0xbe, 0x10, 0x00, // mov si,0x10
+  0xbd, 0x00, 0x04, // mov bp,0x400
+  0xfc,             // cld
+};
+
+static const uint8_t alu[] = {
+  0x01, 0xd8,             // add ax,bx
+  0x29, 0xd1,             // sub cx,dx
+  0x31, 0xfe,             // xor si,di
+  0x09, 0xc3,             // or bx,ax
+  0x21, 0xca,             // and dx,cx
+  0x11, 0xf8,             // adc ax,di
+  0x19, 0xd9,             // sbb cx,bx
+  0x39, 0xc6,             // cmp si,ax
+  0x00, 0xe0,             // add al,ah
+  0x30, 0xd9,             // xor cl,bl
+  0x40,                   // inc ax
+  0x4b,                   // dec bx
+  0x81, 0xc2, 0x34, 0x12, // add dx,0x1234
+  0x83, 0xe9, 0x05,       // sub cx,5
+  0x89, 0xc7,             // mov di,ax
+};
+
+static const uint8_t modrm[] = {
+  0x8b, 0x07,             // mov ax,[bx]
+  0x89, 0x47, 0x02,       // mov [bx+2],ax
+  0x03, 0x40, 0x04,       // add ax,[bx+si+4]
+  0x01, 0x87, 0x00, 0x01, // add [bx+0x100],ax
+  0x8b, 0x16, 0x00, 0x02, // mov dx,[0x200]
+  0x8a, 0x62, 0x08,       // mov ah,[bp+si+8]
+  0x31, 0x4e, 0x06,       // xor [bp+6],cx
+  0x38, 0x24,             // cmp [si],ah
+  0xff, 0x07,             // inc word [bx]
+  0xa1, 0x00, 0x03,       // mov ax,[0x300]
+  0xa3, 0x02, 0x03,       // mov [0x302],ax
+  0xa0, 0x04, 0x03,       // mov al,[0x304]
+  0xa2, 0x05, 0x03,       // mov [0x305],al
+  0x8d, 0x40, 0x10,       // lea ax,[bx+si+0x10]
+  0xc7, 0x47, 0x08, 0x55, 0xaa, // mov word [bx+8],0xaa55
+};
+
+static const uint8_t string[] = {
+  0xb9, 0x00, 0x01, // mov cx,256
+  0x31, 0xf6,       // xor si,si
+  0xbf, 0x00, 0x40, // mov di,0x4000
+  0xf3, 0xa5,       // rep movsw
+  0xb9, 0x00, 0x01, // mov cx,256
+  0xbf, 0x00, 0x80, // mov di,0x8000
+  0xf3, 0xab,       // rep stosw
+  0xb9, 0x00, 0x01, // mov cx,256
+  0x31, 0xf6,       // xor si,si
+  0xbf, 0x00, 0x40, // mov di,0x4000
+  0xf3, 0xa7,       // repe cmpsw
+  0xb9, 0x00, 0x01, // mov cx,256
+  0xbf, 0x00, 0x80, // mov di,0x8000
+  0xf2, 0xae,       // repne scasb
+  0xac,             // lodsb
+  0xad,             // lodsw
+  0xa4,             // movsb
+  0xaa,             // stosb
+};
+
+static const uint8_t jumps[] = {
+  0x39, 0xc0,       // cmp ax,ax
+  0x75, 0x00,       // jnz $+2, not taken
+  0x74, 0x00,       // jz $+2, taken
+  0x72, 0x00,       // jb $+2, not taken
+  0x73, 0x00,       // jnb $+2, taken
+  0xeb, 0x00,       // jmp short $+2
+  0xe9, 0x00, 0x00, // jmp near $+3
+  0x40,             // inc ax
+  0x7f, 0x00,       // jg $+2
+};
+
+static const uint8_t io[] = {
+  0xe4, 0x61,       // in al,0x61 ; unclaimed
+  0xe6, 0x80,       // out 0x80,al ; unclaimed
+  0xb0, 0x00,       // mov al,0
+  0xe6, 0x43,       // out 0x43,al ; PIT counter 0 latch
+  0xe4, 0x40,       // in al,0x40
+  0x88, 0xc4,       // mov ah,al
+  0xe4, 0x40,       // in al,0x40
+  0xba, 0x21, 0x00, // mov dx,0x21
+  0xec,             // in al,dx ; PIC IMR
+  0xed,             // in ax,dx ; split in two byte accesses
+};
+
+/* PIT channel 2 loaded with 0xffff, then MSB only with 0 : the count is
+   0x0000 (65536) and counts down from there, as the MSB read back shows;
+   HLT if it does, INT 3 if not */
+static const uint8_t pit_check[] = {
+  0xb0, 0xb0,       // mov al,0xb0 ; counter 2, LSB then MSB, mode 0
+  0xe6, 0x43,       // out 0x43,al
+  0xb0, 0xff,       // mov al,0xff
+  0xe6, 0x42,       // out 0x42,al
+  0xe6, 0x42,       // out 0x42,al
+  0xb0, 0xa0,       // mov al,0xa0 ; counter 2, MSB only, mode 0
+  0xe6, 0x43,       // out 0x43,al
+  0xb0, 0x00,       // mov al,0
+  0xe6, 0x42,       // out 0x42,al
+  0xe4, 0x42,       // in al,0x42
+  0x3c, 0xff,       // cmp al,0xff
+  0x74, 0x01,       // jz $+3
+  0xcc,             // int3
+  0xf4,             // hlt
+};
+
+static const prog_t progs[] = {
+  { "alu", "ALU reg/reg and reg/imm", alu, sizeof(alu) },
+  { "modrm", "ModR/M memory forms", modrm, sizeof(modrm) },
+  { "string", "string ops, REP and single", string, sizeof(string) },
+  { "jumps", "Jcc taken/not taken, JMP", jumps, sizeof(jumps) },
+  { "io", "port I/O, devices and unclaimed", io, sizeof(io) },
+};
+
+#ifdef XTEM_THREADED
+#define CORE "threaded"
+#else
+#define CORE "switch"
+#endif
+#ifdef XTEM_JIT
+#define JIT 1
+#else
+#define JIT 0
+#endif
+
+static double
+now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+/* write a system ROM running prologue then body in a loop to a temporary
+   file, the reset vector jumping to its start at F000:0000
+   return : 0 on error, or the file name to unlink and free */
+static char*
+prog_rom(const prog_t* p)
+{
+  static uint8_t rom[ROM_SIZE];
+  const char* tmp = getenv("TMPDIR");
+  size_t n = sizeof(prologue);
+  long rel;
+  char* file = malloc(256);
+  int fd;
+  snprintf(file, 256, "%s/xtem_bench.XXXXXX", tmp ? tmp : "/tmp");
+  fd = mkstemp(file);
+  if (fd < 0) {
+    perror(file);
+    free(file);
+    return 0;
+  }
+  memset(rom, 0xf4, sizeof(rom)); // hlt
+  memcpy(rom, prologue, n);
+  memcpy(rom + n, p->body, p->len);
+  rel = (long)n - (long)(n + p->len + 3);
+  rom[n + p->len] = 0xe9; // jmp near back to the body
+  rom[n + p->len + 1] = (uint8_t)rel;
+  rom[n + p->len + 2] = (uint8_t)(rel >> 8);
+  memcpy(rom + 0xfff0, (uint8_t[]){ 0xea, 0x00, 0x00, 0x00, 0xf0 }, 5);
+  if (write(fd, rom, sizeof(rom)) != (ssize_t)sizeof(rom)) {
+    perror(file);
+    close(fd);
+    unlink(file);
+    free(file);
+    return 0;
+  }
+  close(fd);
+  return file;
+}
+
+static void
+report(FILE* out,
+       const char* name,
+       const char* desc,
+       uint64_t insns,
+       uint64_t cycles,
+       double s)
+{
+  fprintf(stderr,
+          "%-8s %8.1f Minsns/s %8.1f Mcycles/s %7.2f ns/insn  %s\n",
+          name,
+          (double)insns / s / 1e6,
+          (double)cycles / s / 1e6,
+          s * 1e9 / (double)insns,
+          desc);
+  fprintf(out,
+          "{\"bench\":\"%s\",\"core\":\"%s\",\"jit\":%d,"
+          "\"insns\":%llu,\"cycles\":%llu,\"seconds\":%.6f,"
+          "\"insns_per_sec\":%.0f,\"cycles_per_sec\":%.0f,"
+          "\"ns_per_insn\":%.3f}\n",
+          name,
+          CORE,
+          JIT,
+          (unsigned long long)insns,
+          (unsigned long long)cycles,
+          s,
+          (double)insns / s,
+          (double)cycles / s,
+          s * 1e9 / (double)insns);
+}
+
+// an instance running p
+static void*
+prog_init(const prog_t* p)
+{
+  char* file = prog_rom(p);
+  void* x;
+  if (!file) {
+    return 0;
+  }
+  x = libxtem_init_roms(0, (libxtem_rom_t[]){ { file, 0 }, { 0, 0 } });
+  unlink(file);
+  free(file);
+  return x;
+}
+
+static int
+check_pit(void)
+{
+  const prog_t p = { "pit", "", pit_check, sizeof(pit_check) };
+  void* x = prog_init(&p);
+  libxtem_exit_t e;
+  if (!x) {
+    return -1;
+  }
+  e = libxtem_run(x, 1000, 0);
+  libxtem_cleanup(x);
+  if (e.reason != LIBXTEM_STOP_HLT) {
+    fprintf(stderr, "pit: wrong count read back, stopped (%d)\n", e.reason);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+bench_prog(FILE* out, const prog_t* p, uint64_t insns)
+{
+  void* x = prog_init(p);
+  libxtem_exit_t e;
+  double t0;
+  if (!x) {
+    return -1;
+  }
+  libxtem_run(x, insns / 100, 0); // warm up the block cache (and the JIT)
+  t0 = now();
+  e = libxtem_run(x, insns, 0);
+  t0 = now() - t0;
+  libxtem_cleanup(x);
+  if (e.reason != LIBXTEM_STOP_BUDGET) {
+    fprintf(stderr, "%s: stopped (%d) at %05x\n", p->name, e.reason, e.pc);
+    return -1;
+  }
+  report(out, p->name, p->desc, e.insns, e.cycles, t0);
+  return 0;
+}
+
+static int
+bench_post(FILE* out, int n)
+{
+  uint64_t insns = 0;
+  uint64_t cycles = 0;
+  double t0 = now();
+  for (int i = 0; i < n; i++) {
+    void* x = libxtem_init(0);
+    libxtem_exit_t e;
+    if (!x) {
+      return -1;
+    }
+    e = libxtem_run(x, 0, 0);
+    libxtem_cleanup(x);
+    if (e.reason != LIBXTEM_STOP_NOTIMP || e.pc != POST_PC) {
+      fprintf(stderr, "post: stopped (%d) at %05x\n", e.reason, e.pc);
+      return -1;
+    }
+    insns += e.insns;
+    cycles += e.cycles;
+  }
+  t0 = now() - t0;
+  report(out, "post", "init, early bios64 POST, cleanup", insns, cycles, t0);
+  fprintf(stderr,
+          "%d instances in %.3f s, %.1f us each\n",
+          n,
+          t0,
+          t0 * 1e6 / n);
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  int arg = 1;
+  int scale = 1;
+  const char* results = "bench.json";
+  FILE* out;
+  int ret = 0;
+  if (arg < argc) {
+    sscanf(argv[arg++], "%d", &scale);
+  }
+  if (arg < argc) {
+    results = argv[arg++];
+  }
+  out = fopen(results, "w");
+  if (!out) {
+    perror(results);
+    return 1;
+  }
+  fprintf(stderr, "core %s, jit %d\n", CORE, JIT);
+  if (check_pit() < 0) {
+    fclose(out);
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(progs) / sizeof(progs[0]); i++) {
+    ret |= bench_prog(out, &progs[i], (uint64_t)INSNS * (uint64_t)scale);
+  }
+  ret |= bench_post(out, POSTS * scale);
+  fclose(out);
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Generate the opcode dispatch tables of libxtem.c from 8086_table.txt
+#
+# Each mnemonic MN is dispatched through the macro H_MN : libxtem.c defines
+# it for the mnemonics it implements, and every other one defaults to
+# op_notimp, so that adding an opcode to the table is data, not code.
+# GRPn opcodes get their own 8 entries sub-table (indexed by ModR/M reg),
+# with the operand forms of the group opcode merged in.
+# The ModR/M table holds the effective address form of each ModR/M byte,
+# and the parity table the PF value of each result low byte.
+
+import sys
+
+WORD = ("Ev", "Gv", "Ew", "Sw", "Iv", "Ov", "Mp",
+	"eAX", "eCX", "eDX", "eBX", "eSP", "eBP", "eSI", "eDI")
+MODRM = ("Eb", "Ev", "Ew", "Gb", "Gv", "Sw", "M", "Mp")
+IMM = {"Ib": 1, "Jb": 1, "I0": 1, "Iv": 2, "Iw": 2, "Jv": 2, "Ob": 2, "Ov": 2,
+	"Ap": 4}
+STRING = ("MOVS", "CMPS", "STOS", "LODS", "SCAS")
+# mnemonics ending a decoded block, STI and POPF for pending interrupts
+JUMP = ("CALL", "RET", "RETF", "INT", "INTO", "IRET", "LOOP", "LOOPZ",
+	"LOOPNZ", "HLT", "STI", "POPF")
+
+# 8088 clocks of the register (or operand-less) and memory forms, the
+# effective address (see EA) and the second bus cycle of word memory
+# operands (4 more) aside; MUL and DIV also have word figures. Taken
+# branches and REP iterations are added by the handlers.
+CYCLES = {"ADD": (3, 16), "OR": (3, 16), "ADC": (3, 16), "SBB": (3, 16),
+	"AND": (3, 16), "SUB": (3, 16), "XOR": (3, 16), "CMP": (3, 9),
+	"TEST": (3, 9), "MOV": (2, 9), "XCHG": (4, 17), "LEA": (2, 2),
+	"LDS": (24, 24), "LES": (24, 24), "INC": (3, 15), "DEC": (3, 15),
+	"NOT": (3, 16), "NEG": (3, 16), "ROL": (2, 15), "ROR": (2, 15),
+	"RCL": (2, 15), "RCR": (2, 15), "SHL": (2, 15), "SHR": (2, 15),
+	"SAR": (2, 15), "MUL": (74, 80, 126, 132), "IMUL": (89, 95, 141, 147),
+	"DIV": (85, 91, 153, 159), "IDIV": (107, 113, 175, 181),
+	"PUSH": (15, 20), "POP": (12, 21), "PUSHF": (14, 14), "POPF": (12, 12),
+	"CALL": (23, 25), "RET": (20, 20), "RETF": (34, 34), "JMP": (15, 18),
+	"INT": (71, 71), "INTO": (4, 4), "IRET": (44, 44), "LOOP": (5, 5),
+	"LOOPZ": (6, 6), "LOOPNZ": (5, 5), "JCXZ": (6, 6), "IN": (10, 10),
+	"OUT": (10, 10), "MOVSB": (18, 18), "MOVSW": (26, 26), "CMPSB": (22, 22),
+	"CMPSW": (30, 30), "STOSB": (11, 11), "STOSW": (15, 15),
+	"LODSB": (12, 12), "LODSW": (16, 16), "SCASB": (15, 15),
+	"SCASW": (19, 19), "XLAT": (11, 11), "LAHF": (4, 4), "SAHF": (4, 4),
+	"CBW": (2, 2), "CWD": (5, 5), "AAA": (4, 4), "AAS": (4, 4),
+	"DAA": (4, 4), "DAS": (4, 4), "AAM": (83, 83), "AAD": (60, 60),
+	"NOP": (3, 3), "WAIT": (3, 3)}
+ALU = ("ADD", "OR", "ADC", "SBB", "AND", "SUB", "XOR")
+# jumps taken : not taken, by the handlers
+JCC_NOT_TAKEN = 4
+
+def cycles(mn, forms, word):
+	c = CYCLES.get(mn, (2, 2)) # flags, prefixes, HLT...
+	if len(c) == 4:
+		c = c[2:] if word else c[:2]
+	reg, mem = c
+	imm = len(forms) > 1 and forms[1][0] == "I"
+	if mn.startswith("J") and mn not in ("JMP", "JCXZ"):
+		reg = mem = JCC_NOT_TAKEN
+	elif imm and mn in ALU:
+		reg, mem = 4, 17
+	elif imm and mn in ("CMP", "MOV"):
+		reg, mem = 4, 10
+	elif imm and mn == "TEST":
+		reg, mem = 5, 11
+	elif forms and forms[0][0] == "G" and mn in ALU + ("MOV",):
+		mem -= 7 if mn in ALU else 1 # memory source
+	elif mn == "MOV" and ("Ob" in forms or "Ov" in forms): # accumulator
+		reg = mem = 14 if word else 10
+	elif mn in ("INC", "DEC") and word and forms[0] not in MODRM:
+		reg = 2
+	if word and any(o in MODRM for o in forms):
+		mem += 4
+	return reg, mem
+
+def parse(fname):
+	opcodes = {}
+	groups = {}
+	for line in open(fname):
+		f = line.split()
+		if len(f) < 2:
+			continue
+		if f[0].startswith("GRP"):
+			g, n = f[0].split("/")
+			groups.setdefault(g, {})[int(n)] = f[1:]
+		else:
+			opcodes[int(f[0], 16)] = f[1:]
+	return opcodes, groups
+
+def ident(mn):
+	return mn.replace(":", "_")
+
+def entry(mn, forms, grp=None):
+	if mn == "--":
+		return '{ "--", op_notimp, { A_NONE, A_NONE }, OPF_JUMP, 0, 0, '\
+			'{ 0, 0 } }'
+	a = ["A_" + o for o in forms] + ["A_NONE"] * (2 - len(forms))
+	fl = []
+	if any(o in WORD for o in forms) or (not forms and mn[:4] in STRING
+			and mn[4:] == "W"):
+		fl += ["OPF_W"]
+	if any(o in MODRM for o in forms) or grp is not None:
+		fl += ["OPF_MODRM"]
+	if mn in JUMP or mn.startswith("J"):
+		fl += ["OPF_JUMP"]
+	imm = sum(IMM.get(o, 0) for o in forms)
+	return '{ "%s", H_%s, { %s }, %s, %d, %s, { %d, %d } }' % (mn, ident(mn),
+		", ".join(a), " | ".join(fl) or "0", imm, grp or "0",
+		*cycles(mn, forms, "OPF_W" in fl))
+
+# base, index registers of rm (8 => none), and whether BP implies SS
+RM = [(3, 6, 0), (3, 7, 0), (5, 6, 1), (5, 7, 1), (6, 8, 0), (7, 8, 0),
+	(5, 8, 1), (3, 8, 0)]
+# effective address clocks of rm, without and with a displacement
+EA = [(7, 11), (8, 12), (8, 12), (7, 11), (5, 9), (5, 9), (5, 9), (5, 9)]
+RMNAME = ["BX+SI", "BX+DI", "BP+SI", "BP+DI", "SI", "DI", "BP", "BX"]
+
+def modrm_table():
+	print("static const modrm_t modrm_table[256] = {")
+	for b in range(256):
+		mod, reg, rm = b >> 6, (b >> 3) & 7, b & 7
+		base, index, ss = RM[rm]
+		disp = [0, 1, 2, 0][mod]
+		name = RMNAME[rm]
+		ea = EA[rm][disp > 0]
+		if mod == 3:
+			base, index, ss, name, ea = 8, 8, 0, "reg", 0
+		elif mod == 0 and rm == 6:
+			base, ss, disp, name, ea = 8, 0, 2, "disp16", 6
+		elif disp:
+			name += "+disp%d" % (8 * disp)
+		print("  [0x%02X] = { %d, %d, %d, %d, %d, %d, %d, %d }, /* %s */" % (b,
+			mod, reg, rm, disp, base, index, ss, ea, name))
+	print("};")
+
+def parity_table():
+	print("static const uint8_t parity_table[256] = {")
+	for b in range(0, 256, 16):
+		print("  %s," % ", ".join("%d" % (bin(b + i).count("1") % 2 == 0)
+			for i in range(16)))
+	print("};")
+
+def main(fname):
+	opcodes, groups = parse(fname)
+	mnems = sorted(set(ident(f[0]) for f in list(opcodes.values())
+		+ [s for g in groups.values() for s in g.values()] if f[0] != "--"))
+	print("/* Generated by gen_table.py from %s, do not edit. */" % fname)
+	print()
+	for mn in mnems:
+		print("#ifndef H_%s" % mn)
+		print("#define H_%s op_notimp" % mn)
+		print("#endif")
+	print()
+	grp_opcodes = [o for o in sorted(opcodes) if opcodes[o][0] in groups]
+	print("static const op_t grp_table[%d][8] = {" % len(grp_opcodes))
+	for o in grp_opcodes:
+		g = opcodes[o]
+		print("  /* %02X %s */ {" % (o, " ".join(g)))
+		for n in range(8):
+			sub = groups[g[0]].get(n, ["--"])
+			print("    %s," % entry(sub[0], sub[1:] or g[1:]))
+		print("  },")
+	print("};")
+	print()
+	print("static const op_t op_table[256] = {")
+	for o in range(256):
+		f = opcodes.get(o, ["--"])
+		grp = None
+		if f[0] in groups:
+			grp = "grp_table[%d]" % grp_opcodes.index(o)
+		print("  [0x%02X] = %s," % (o, entry(f[0], f[1:], grp)))
+	print("};")
+	print()
+	modrm_table()
+	print()
+	parity_table()
+
+if __name__ == "__main__":
+	main(sys.argv[1] if len(sys.argv) > 1 else "8086_table.txt")
@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
+#define _GNU_SOURCE // memfd_create
+
 #include "libxtem.h"
 
 #include <inttypes.h>
@@ -7,8 +9,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <malloc.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef XTEM_JIT
+#include <stddef.h>
+#endif
 
 #define NOTIMP(...)                                                            \
   do {                                                                         \
@@ -51,20 +64,206 @@ typedef struct
   uint16_t es;
 } segs_t;
 
+#define OF 0x800
+#define DF 0x400
+#define IF 0x200
+#define TF 0x100
+#define SF 0x080
+#define ZF 0x040
+#define AF 0x010
+#define PF 0x004
+#define CF 0x001
+
+/* guest memory map
+   a flat host mapping of the 1 MiB address space, followed by the HMA
+   (what FFFF:0010 and up reach), which aliases the first 64 KiB as on the
+   8086; page[] holds the MEM_* type of each 4 KiB page */
+#define RAM_FIRST 0x00000
+#define RAM_LAST 0x7ffff
+//#define BIOS_FIRST 0xf8000
+#define BIOS_FIRST 0xf0000
+#define BIOS_LAST 0xfffff
+#define MEM_LAST 0xfffff
+#define MEM_SIZE (MEM_LAST + 1)
+#define HMA_SIZE 0x10000
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGES ((MEM_SIZE + HMA_SIZE) >> PAGE_SHIFT)
+
+enum
+{
+  MEM_UNMAPPED, // reads 0xCC, writes are dropped
+  MEM_RAM,
+  MEM_ROM,  // writes are dropped
+  MEM_MMIO, // no device model yet, behaves as unmapped
+};
+
+/* execution trace
+   fixed size records in a ring, written by the emulation and published
+   through head, so that libxtem_trace_dump() can read it concurrently;
+   trace.py decodes dumps. Built with XTEM_TRACE only, else TRACE() is 0
+   and the tracing code compiles away */
+#ifdef XTEM_TRACE
+#define TRACE(x, lvl) ((x)->trace.level >= (lvl))
+#else
+#define TRACE(x, lvl) 0
+#endif
+#define TRACE_RECS (1 << 16)
+#define TRACE_NREGS 13 // AX..DI, ES CS SS DS, FL
+
+enum
+{
+  TR_INSN, // addr : PC, b : instruction bytes, v : CS
+  TR_REG,  // n : register, v : new value, addr : old value
+  TR_MEMR, // n : size, addr : linear address, v : value
+  TR_MEMW, // n : size, addr : linear address
+  TR_OUT,  // n : size, addr : port, v : value
+  TR_IN,   // n : size, addr : port, v : value
+};
+
+typedef struct
+{
+  uint8_t type; // TR_*
+  uint8_t n;
+  uint16_t v;
+  uint32_t addr;
+  uint8_t b[8];
+} trace_rec_t;
+
+typedef struct
+{
+  int level;                // LIBXTEM_TRACE_*
+  trace_rec_t* ring;        // TRACE_RECS, allocated on first use
+  _Atomic uint64_t head;    // records written so far
+  _Atomic uint64_t wr;      // the record being written, or the last one
+  uint16_t r[TRACE_NREGS];  // registers before the current instruction
+} trace_t;
+
+/* hot-spot profiler
+   counts the instructions run per linear PC, per opcode, and per calling
+   context : a tree of the CALL and interrupt targets entered, left by RET
+   and IRET, dumped as folded stacks for flamegraph.pl. Built with XTEM_PROF
+   only, else PROF() is 0 and the counting compiles away; translations
+   don't run while it is on */
+#ifdef XTEM_PROF
+#define PROF(x) ((x)->prof.on)
+#else
+#define PROF(x) 0
+#endif
+#define PROF_PCS (MEM_SIZE + HMA_SIZE)
+#define PROF_NODES 4096 // calling contexts
+#define PROF_HASH (PROF_NODES * 2)
+#define PROF_DEPTH 64
+
+typedef struct
+{
+  uint64_t count; // instructions run in this context
+  uint32_t addr;  // linear address entered
+  uint16_t parent;
+  uint16_t depth;
+} prof_node_t;
+
+typedef struct
+{
+  int on;
+  uint64_t* pc;        // PROF_PCS, allocated on first use, like node and hash
+  uint64_t op[256];    // by first instruction byte
+  prof_node_t* node;   // node[0] : outside of any call
+  uint16_t* hash;      // of (parent, addr), index in node[], 0 => free
+  int nodes;
+  uint16_t cur;        // current context
+  uint32_t lost;       // calls entered past PROF_DEPTH or PROF_NODES
+} prof_t;
+
+/* device events
+   timed devices schedule their next deadline, in cycles, on a min-heap :
+   the run loops only compare x->cycles with x->deadline, between
+   instructions (between blocks, for translations), and run the events due
+   once it is reached */
+#define EV_MAX 16
+
+typedef struct
+{
+  uint64_t when;
+  libxtem_event_t fn;
+  void* user;
+} ev_t;
+
+/* port I/O
+   io_map[] gives the device of each port, so that an access is one indirect
+   call; word accesses to devices that don't take them are split in two */
+#define PORTS 0x10000
+#define DEV_MAX 32
+
+/* 8259A interrupt controllers
+   pic[0] is the master, pic[1] a slave on its IR2 once the master is
+   initialized in cascade mode (the XT has no slave, its ports aren't
+   claimed); priorities are fixed, IR0 first */
+typedef struct
+{
+  uint8_t irr, isr, imr;
+  uint8_t vector;   // ICW2, of IR0
+  uint8_t icw;      // next ICW expected, 0 => OCWs
+  uint8_t icw1;
+  uint8_t icw4;
+  uint8_t read_isr; // OCW3, reading port 0 gives the ISR instead of the IRR
+} pic_t;
+
+/* 8253 interval timer
+   counts are computed from the cycle they were loaded at, only channel 0
+   schedules events, for its IRQ 0; the gates are always high */
+#define PIT_CLOCK 4 // CPU clocks per PIT clock, 4.77 MHz / 1.19 MHz
+
+typedef struct
+{
+  uint64_t start;  // cycle the count was loaded at
+  uint16_t reload; // 0 => 65536
+  uint16_t latch;
+  uint8_t mode;    // 0 to 5
+  uint8_t rw;      // 1 : LSB, 2 : MSB, 3 : LSB then MSB
+  uint8_t wr_msb;  // the next write is the MSB
+  uint8_t rd_msb;  // the next read is the MSB
+  uint8_t latched; // latch holds the count to read
+  uint8_t armed;   // a count was loaded
+} pit_chan_t;
+
+/* breakpoints
+   linear addresses, not patched into memory : blocks end before them, and
+   those starting on a page of bp_map check whether they start on one */
+#define BP_MAX 64
+
+/* watchpoints
+   data accesses to the pages of watch_map check them, instructions fetches
+   and debugger accesses don't; a hit makes the deadline immediate, so that
+   the run loops stop after the instruction */
+#define WATCH_MAX 16
+
+#define WATCH_W LIBXTEM_WATCH_WRITE
+#define WATCH_R LIBXTEM_WATCH_READ // WATCH_W | WATCH_R : any access
+
+typedef struct
+{
+  uint32_t addr; // below MEM_SIZE, the HMA is the same memory
+  uint32_t len;
+  int type; // WATCH_*
+} watch_t;
+
 typedef struct
 {
   regs_t r;
   segs_t s;
   uint16_t ip;
   uint16_t fl;
-  unsigned char* bios;
-  unsigned char* ram;
-  unsigned char* membuf;
-  size_t membuflen;
+  uint8_t* mem;                // MEM_SIZE + HMA_SIZE
+  uint8_t page[PAGES];         // MEM_*
+  uint8_t sink[PAGE_SIZE + 1]; // target of dropped writes, words at 0xfff too
   enum
   {
-    SEG_DS,
-    SEG_ES
+    SEG_NONE,
+    SEG_ES,
+    SEG_CS,
+    SEG_SS,
+    SEG_DS
   } def_seg;
   enum
   {
@@ -72,8 +271,68 @@ typedef struct
     REP_REPNZ,
     REP_REPZ
   } def_rep;
+  uint16_t pfx_ip; // of the first prefix, where a yielding REP restarts
+  struct bc_s* bc; // decoded block cache
+  uint64_t cycles;   // clocks run
+  uint64_t deadline; // of the next event or of stop, whichever comes first
+  uint64_t stop;     // libxtem_run() cycle budget
+  ev_t ev[EV_MAX];   // heap of the pending events, soonest first
+  int evs;
+  uint64_t dirty[(MEM_SIZE >> PAGE_SHIFT) / 64]; // pages written since snap
+  struct snap_s* snap; // last snapshot taken or restored
+#ifdef XTEM_JIT
+  struct jit_s* jit; // translated blocks
+#endif
+  struct
+  {
+    uint32_t r; // result, with the carry out bit
+    uint16_t a, b;
+    uint8_t op; // LF_*, LF_NONE => FL is up to date
+    uint8_t w;
+  } lf;
+  trace_t trace;
+  prof_t prof;
+  uint8_t io_map[PORTS];      // index in dev[] of the device claiming a port
+  libxtem_dev_t dev[DEV_MAX]; // dev[0] : unclaimed ports
+  int devs;
+  pic_t pic[2];
+  pit_chan_t pit[3];
+  int irq;      // the master PIC has a request for the CPU
+  int halted;   // by HLT, until an interrupt
+  uint64_t idle; // cycles skipped while halted or busy-waiting
+  uint32_t bp[BP_MAX];
+  int bps;
+  uint64_t bp_map[(PAGES + 63) / 64]; // pages with breakpoints
+  size_t bp_hit;     // the last breakpoint stopped at
+  uint64_t bp_insns; // instructions run then, resuming runs it
+  watch_t watch[WATCH_MAX];
+  int watches;
+  uint64_t watch_map[(MEM_SIZE >> PAGE_SHIFT) / 64]; // pages with watches
+  struct
+  {
+    uint32_t addr; // accessed
+    int type;      // WATCH_*, 0 => none
+  } watch_hit;
+  int io_exit; // unclaimed port accesses stop the run loops, with RET_IO
+  struct
+  {
+    uint16_t port;
+    uint16_t value;
+    uint8_t size;
+    uint8_t out;
+  } io; // last port access, for RET_IO
 } xtem_t;
 
+enum
+{
+  LF_NONE,
+  LF_ADD,
+  LF_SUB,
+  LF_LOGIC,
+  LF_INC,
+  LF_DEC,
+};
+
 static void
 xtem_reset(xtem_t* x)
 {
@@ -93,753 +352,3375 @@ xtem_reset(xtem_t* x)
   ES = 0x0000;
 }
 
-#define RAM_FIRST 0x00000
-#define RAM_LAST 0x80000
-//#define BIOS_FIRST 0xf8000
-#define BIOS_FIRST 0xf0000
-#define BIOS_LAST 0xfffff
-#define MEM_LAST 0xfffff
+// cycle of the soonest event, or of the end of the run
+static uint64_t
+ev_next(xtem_t* x)
+{
+  return x->evs && x->ev[0].when < x->stop ? x->ev[0].when : x->stop;
+}
 
-static int
-xtem_load_bios(xtem_t* x, char* bios_file)
+/* the run loops take an interrupt request, or wait while halted, when they
+   check for events : those make the deadline immediate */
+static void
+ev_deadline(xtem_t* x)
 {
-  size_t bioslen = 0;
-  FILE* f = fopen(bios_file, "rb");
-  if (!f) {
-    perror("open bios file");
-    exit(1);
-  }
-  fseek(f, 0, SEEK_END);
-  bioslen = (size_t)ftell(f);
-  printf("reading bios file %lu\n", (unsigned long)bioslen);
-  rewind(f);
-  x->bios = calloc(1, bioslen);
-  fread(x->bios, bioslen, 1, f);
-  fclose(f);
-  return 42;
+  x->deadline = (x->irq && (FL & IF)) || x->halted || x->watch_hit.type
+                  ? 0
+                  : ev_next(x);
 }
 
-static xtem_t*
-xtem_init()
+static void
+ev_swap(xtem_t* x, int i, int j)
 {
-  xtem_t* x = calloc(1, sizeof(xtem_t));
-  xtem_reset(x);
-  //	xtem_load_bios(x, "bios");
-  xtem_load_bios(x, "bios64");
-  x->ram = calloc(1, RAM_LAST - RAM_FIRST + 1);
-  return x;
+  ev_t e = x->ev[i];
+  x->ev[i] = x->ev[j];
+  x->ev[j] = e;
 }
 
-static int
-xtem_cleanup(xtem_t* x)
+// restore the heap order around ev[i]
+static void
+ev_sift(xtem_t* x, int i)
 {
-  if (x) {
-    if (x->bios) {
-      free(x->bios);
+  while (i && x->ev[i].when < x->ev[(i - 1) / 2].when) {
+    ev_swap(x, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= x->evs) {
+      break;
     }
-    if (x->ram) {
-      free(x->ram);
+    if (c + 1 < x->evs && x->ev[c + 1].when < x->ev[c].when) {
+      c++;
     }
-    if (x->membuf) {
-      free(x->membuf);
+    if (x->ev[i].when <= x->ev[c].when) {
+      break;
     }
-    free(x);
+    ev_swap(x, i, c);
+    i = c;
   }
-  return 0;
 }
 
-/*	read memory without side effects
-        caller expects a backdoor memory pointer in return
-*/
+// drop the pending event of fn and user, if any
 static void
-memr(xtem_t* x, void** dest, size_t* len, size_t addr)
+ev_cancel(xtem_t* x, libxtem_event_t fn, void* user)
 {
-  if (/*(addr >= RAM_FIRST) &&*/ (addr <= RAM_LAST)) {
-    *dest = x->ram + addr - RAM_FIRST;
-    if (addr + *len > RAM_LAST) {
-      *len = RAM_LAST - addr + 1;
-    }
-  } else if ((addr >= BIOS_FIRST) && (addr <= BIOS_LAST)) {
-    *dest = x->bios + addr - BIOS_FIRST;
-    // 4 10 7 =>
-    if (addr + *len > BIOS_LAST) {
-      *len = BIOS_LAST - addr + 1;
+  for (int i = 0; i < x->evs; i++) {
+    if (x->ev[i].fn == fn && x->ev[i].user == user) {
+      x->ev[i] = x->ev[--x->evs];
+      if (i < x->evs) {
+        ev_sift(x, i);
+      }
+      break;
     }
-  } else {
-    if (!x->membuf) {
-      x->membuf = calloc(1, x->membuflen = *len);
+  }
+  ev_deadline(x);
+}
+
+/* call fn with user at cycle when, instead of when it was due before
+   return : <0 if there are too many pending events */
+static int
+ev_add(xtem_t* x, uint64_t when, libxtem_event_t fn, void* user)
+{
+  ev_cancel(x, fn, user);
+  if (x->evs >= EV_MAX) {
+    return -1;
+  }
+  x->ev[x->evs] = (ev_t){ when, fn, user };
+  ev_sift(x, x->evs++);
+  ev_deadline(x);
+  return 0;
+}
+
+// run the events due, they may schedule new ones
+static void
+ev_run(xtem_t* x)
+{
+  while (x->evs && x->ev[0].when <= x->cycles) {
+    ev_t e = x->ev[0];
+    x->ev[0] = x->ev[--x->evs];
+    ev_sift(x, 0);
+    e.fn(e.user, x->cycles);
+  }
+  ev_deadline(x);
+}
+
+/* decoded block cache
+   straight-line runs of pre-decoded instructions keyed by linear PC;
+   code[] counts the cached blocks covering each page, so that memw() only
+   has to invalidate when it hits a page holding cached code */
+#define BC_BITS 10
+#define BC_BLOCKS (1 << BC_BITS)
+#define BC_HASH(pc) (((pc) ^ ((pc) >> BC_BITS)) & (BC_BLOCKS - 1))
+#define BC_INSNS 32
+#define BC_NONE ((size_t)-1)
+#define INSN_LEN 6 // bytes of the longest instruction, prefixes aside
+
+typedef struct
+{
+  const struct op_s* op; // 0 => end of the block
+#ifdef XTEM_THREADED
+  const void* lbl; // handler label of the threaded core, 0 => unresolved
+#endif
+  uint8_t len;
+  uint8_t cycles; // clocks, but for what the handler adds
+  uint8_t b[INSN_LEN];
+} insn_t;
+
+typedef struct
+{
+  size_t pc;  // BC_NONE when empty
+  size_t end; // linear address after the last instruction
+  int n;
+  int poll; // only reads memory and ports, may be a busy-wait loop
+  int bp;   // starts on a page with breakpoints
+#ifdef XTEM_JIT
+  uint32_t count; // runs, up to JIT_THRESHOLD
+  uint8_t* jit;   // translated code entry, 0 => interpreted
+  uint8_t* body;  // translated code, past the prologue, for chaining
+#endif
+  insn_t insn[BC_INSNS + 1]; // terminated by an op=0 entry
+} block_t;
+
+typedef struct bc_s
+{
+  block_t block[BC_BLOCKS];
+  uint16_t code[PAGES + 1]; // a block may run past the HMA
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t invalidations;
+  uint64_t insns; // instructions executed
+} bc_t;
+
+#ifdef XTEM_JIT
+#ifndef __x86_64__
+#error "XTEM_JIT needs an x86-64 host"
+#endif
+/* x86-64 translation of hot blocks, call threaded (see jit_translate())
+   code is bump allocated, and flushed as a whole when full */
+#define JIT_THRESHOLD 16
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_BLOCK_MAX (BC_INSNS * 160 + 128)
+#define JIT_CHAIN 64
+
+typedef struct jit_s
+{
+  uint8_t* code;
+  size_t used;
+  int chain; // blocks left to chain before returning to block_run()
+  uint64_t blocks;
+  uint64_t flushes;
+} jit_t;
+#endif
+
+static void
+mem_map(xtem_t* x, size_t first, size_t last, int type)
+{
+  for (size_t p = first >> PAGE_SHIFT; p <= last >> PAGE_SHIFT; p++) {
+    x->page[p] = (uint8_t)type;
+    if (p < HMA_SIZE >> PAGE_SHIFT) {
+      x->page[p + (MEM_SIZE >> PAGE_SHIFT)] = (uint8_t)type;
     }
-    if (*len > x->membuflen) {
-      x->membuf = realloc(x->membuf, x->membuflen = *len);
+  }
+}
+
+/* map the guest memory : MEM_SIZE bytes of a memfd, and its first
+   HMA_SIZE bytes again right after, for the wrap around */
+static int
+mem_init(xtem_t* x)
+{
+  int fd = memfd_create("xtem", 0);
+  uint8_t* mem;
+  if (fd < 0 || ftruncate(fd, MEM_SIZE) < 0) {
+    perror("memfd");
+    return -1;
+  }
+  mem = mmap(0,
+             MEM_SIZE + HMA_SIZE,
+             PROT_READ | PROT_WRITE,
+             MAP_SHARED,
+             fd,
+             0); // reserve the range, the HMA part gets replaced below
+  if (mem == MAP_FAILED ||
+      mmap(mem + MEM_SIZE,
+           HMA_SIZE,
+           PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED,
+           fd,
+           0) == MAP_FAILED) {
+    perror("mmap guest memory");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  x->mem = mem;
+  return 0;
+}
+
+/* map the ROM image file at guest address addr, or ending at BIOS_LAST
+   when addr is 0, where the reset vector is
+   page aligned images are mapped read-only from the file, so that the
+   instances of a process (and of the host) share their pages, others are
+   copied */
+static int
+xtem_load_rom(xtem_t* x, const char* rom_file, size_t addr)
+{
+  struct stat st;
+  size_t len;
+  int fd = open(rom_file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(rom_file);
+    if (fd >= 0) {
+      close(fd);
     }
-    for (size_t i = 0; i < *len; i++) {
-      if ((addr + i) <= MEM_LAST) {
-        x->membuf[i] = 0xcc;
-      } else {
+    return -1;
+  }
+  len = (size_t)st.st_size;
+  if (!addr) {
+    addr = BIOS_LAST + 1 - len;
+  }
+  if (!len || len > MEM_SIZE - HMA_SIZE || addr < HMA_SIZE ||
+      addr + len > MEM_SIZE) {
+    fprintf(stderr, "%s: %zu bytes don't fit at %05zx\n", rom_file, len, addr);
+    close(fd);
+    return -1;
+  }
+  printf("mapping rom %s at %05zx (%zu bytes)\n", rom_file, addr, len);
+  if ((addr & (PAGE_SIZE - 1)) ||
+      mmap(x->mem + addr, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+        MAP_FAILED) {
+    for (size_t i = 0; i < len;) {
+      ssize_t n = pread(fd, x->mem + addr + i, len - i, (off_t)i);
+      if (n <= 0) {
+        perror(rom_file);
+        close(fd);
+        return -1;
       }
+      i += (size_t)n;
     }
-    *dest = x->membuf;
   }
+  close(fd);
+  mem_map(x, addr, addr + len - 1, MEM_ROM);
+  return 0;
+}
+
+// unclaimed ports read all ones, and ignore writes
+static uint16_t
+io_none_in(void* user, uint16_t port, int size)
+{
+  user = user;
+  port = port;
+  return size == 2 ? 0xffff : 0xff;
 }
 
 static void
-memw(xtem_t* x, void** dest, size_t* len, size_t addr)
+io_none_out(void* user, uint16_t port, uint16_t value, int size)
 {
-  memr(x, dest, len, addr);
+  user = user;
+  port = port;
+  value = value;
+  size = size;
 }
 
+/* claim ports first to last for dev, over what previously claimed them
+   return : <0 if there are too many devices */
 static int
-parity_odd16(uint16_t val)
+xtem_dev_add(xtem_t* x, uint16_t first, uint16_t last, const libxtem_dev_t* dev)
 {
-  int count = 0;
-  for (int i = 0; i < 16; i++) {
-    if (val & (1 << i)) {
-      count++;
-    }
+  libxtem_dev_t* d;
+  if (x->devs >= DEV_MAX) {
+    return -1;
   }
-  if (count % 2) {
-    return 0;
+  d = &x->dev[x->devs];
+  *d = *dev;
+  if (!d->in) {
+    d->in = io_none_in;
   }
-  return 1;
+  if (!d->out) {
+    d->out = io_none_out;
+  }
+  for (size_t port = first; port <= last; port++) {
+    x->io_map[port] = (uint8_t)x->devs;
+  }
+  return x->devs++;
 }
 
-#define CMPRANGE(p, a, b) ((port >= a) && (port <= b))
-#define CMPRANGE0(p, a) (port == a)
-char*
-hint_out0(int port, int data)
+static uint16_t
+io_in(xtem_t* x, uint16_t port, int size)
 {
-  data = data;
-  return CMPRANGE(port, 0x0000, 0x001F)
-           ? "The first legacy DMA controller, often used for transfers to "
-             "floppies."
-         : CMPRANGE(port, 0x0020, 0x0021)
-           ? "The first Programmable Interrupt Controller"
-         : CMPRANGE(port, 0x0022, 0x0023)
-           ? "Access to the Model-Specific Registers of Cyrix processors."
-         : CMPRANGE(port, 0x0040, 0x0047)
-           ? "The PIT (Programmable Interval Timer)"
-         : CMPRANGE(port, 0x0060, 0x0064)
-           ? "The '8042' PS/2 Controller or its predecessors, dealing with "
-             "keyboards and mice."
-         : CMPRANGE(port, 0x0070, 0x0071) ? "The CMOS and RTC registers"
-         : CMPRANGE(port, 0x0080, 0x008F) ? "The DMA (Page registers)"
-         : CMPRANGE0(port, 0x0092)
-           ? "The location of the fast A20 gate register"
-         : CMPRANGE(port, 0x00A0, 0x00A1) ? "The second PIC"
-         : CMPRANGE(port, 0x00C0, 0x00DF)
-           ? "The second DMA controller, often used for soundblasters"
-         : CMPRANGE0(port, 0x00E9)
-           ? "Home of the Port E9 Hack. Used on some emulators to directly "
-             "send text to the hosts' console."
-         : CMPRANGE(port, 0x0170, 0x0177)
-           ? "The secondary ATA harddisk controller."
-         : CMPRANGE(port, 0x01F0, 0x01F7)
-           ? "The primary ATA harddisk controller."
-         : CMPRANGE(port, 0x0278, 0x027A) ? "Parallel port"
-         : CMPRANGE(port, 0x02F8, 0x02FF) ? "Second serial port"
-         : CMPRANGE(port, 0x03B0, 0x03DF)
-           ? "The range used for the IBM VGA, its direct predecessors, as well "
-             "as any modern video card in legacy mode."
-         : CMPRANGE(port, 0x03F0, 0x03F7) ? "Floppy disk controller"
-         : CMPRANGE(port, 0x03F8, 0x03FF) ? "First serial port"
-                                          : "???";
+  const libxtem_dev_t* d = &x->dev[x->io_map[port]];
+  if (size == 2 && !d->word) {
+    return (uint16_t)(io_in(x, port, 1) |
+                      io_in(x, (uint16_t)(port + 1), 1) << 8);
+  }
+  return d->in(d->user, port, size);
 }
-char*
-hint_out(int port, int data)
+
+static void
+io_out(xtem_t* x, uint16_t port, uint16_t value, int size)
 {
-  data = data;
-  return CMPRANGE(port, 0x0000, 0x001F)
-           ? "first legacy DMA controller, floppies"
-         : CMPRANGE(port, 0x0020, 0x0021)
-           ? "first Programmable Interrupt Controller"
-         : CMPRANGE(port, 0x0022, 0x0023)
-           ? "Model-Specific Registers of Cyrix processors"
-         : CMPRANGE(port, 0x0040, 0x0047) ? "PIT (Programmable Interval Timer)"
-         : CMPRANGE(port, 0x0060, 0x0064)
-           ? "'8042' PS/2 Controller, keyboards and mice"
-         : CMPRANGE(port, 0x0070, 0x0071) ? "CMOS and RTC registers"
-         : CMPRANGE(port, 0x0080, 0x008F) ? "DMA (Page registers)"
-         : CMPRANGE0(port, 0x0092)        ? "fast A20 gate register"
-         : CMPRANGE(port, 0x00A0, 0x00A1) ? "second PIC"
-         : CMPRANGE(port, 0x00C0, 0x00DF)
-           ? "second DMA controller, soundblasters"
-         : CMPRANGE0(port, 0x00E9)        ? "Port E9 Hack"
-         : CMPRANGE(port, 0x0170, 0x0177) ? "secondary ATA harddisk controller"
-         : CMPRANGE(port, 0x01F0, 0x01F7) ? "primary ATA harddisk controller"
-         : CMPRANGE(port, 0x0278, 0x027A) ? "Parallel port"
-         : CMPRANGE(port, 0x02F8, 0x02FF) ? "Second serial port"
-         : CMPRANGE(port, 0x03B0, 0x03DF) ? "VGA"
-         : CMPRANGE(port, 0x03F0, 0x03F7) ? "Floppy disk controller"
-         : CMPRANGE(port, 0x03F8, 0x03FF) ? "First serial port"
-                                          : "???";
+  const libxtem_dev_t* d = &x->dev[x->io_map[port]];
+  if (size == 2 && !d->word) {
+    io_out(x, port, value & 0xff, 1);
+    io_out(x, (uint16_t)(port + 1), value >> 8, 1);
+    return;
+  }
+  d->out(d->user, port, value, size);
 }
-// return : 0 => executed 1 insn succesfully
-// return : 1 => executed 1 prefix succesfully (eg: not atomic for IRQ handling)
-// return : <0 => error
+
+#define ICW1_ICW4 0x01 // an ICW4 follows
+#define ICW1_SNGL 0x02 // no cascade
+#define ICW4_AEOI 0x02 // automatic end of interrupt
+#define PIC_CASCADE 2  // master input of the slave
+
+// highest priority request not masked nor below one in service, or -1
 static int
-step(xtem_t* x)
+pic_pending(const pic_t* p)
 {
-  int ret = 0;
-  uint8_t *_opc = 0, *opc;
-  size_t len = 8;
-  size_t pc = (size_t)CS * 16 + IP;
-  printf("%05x ", (unsigned)pc);
-  memr(x, (void**)&_opc, &len, pc);
-  if (!_opc) {
-    return 1;
-  }
-  opc = _opc;
-  uint8_t Ib, Eb, Ev;
-  uint16_t Iw;
-  uint16_t seg;
-  int pfx_seg = 0;
-  int pfx_rep = 0;
-  uint8_t mod, reg, rm;
-#if 1
-  uint16_t* mem;
-  size_t addr;
-  uint16_t Gv;
-#endif
-#define OF 0x800
-#define DF 0x400
-#define IF 0x200
-#define TF 0x100
-#define SF 0x080
-#define ZF 0x040
-#define AF 0x010
-#define PF 0x004
-#define CF 0x001
-  //   printf("RIGHT NOW DS=%04" PRIx16 "\n", DS);
-  while (1) {
-    switch (opc[0]) {
-      case 0x26: //	ES:
-        IP++;
-        printf("ES:\n");
-        x->def_seg = SEG_ES;
-        pfx_seg = 1;
-        break;
-      case 0xF3: //	REPZ:
-        IP++;
-        printf("REPZ:\n");
-        x->def_rep = REP_REPZ;
-        pfx_rep = 1;
-        break;
-      case 0x33: //	XOR		Gv	Ev
-        IP++;
-        Ev = *(uint8_t*)(opc + 1);
-        IP++;
-        printf("XOR		Gv	Ev\n");
-        switch (Ev) {
-          case 0xC0: // ax,ax
-            Iw = AX = AX ^ AX;
-            break;
-          case 0xFF: // di,di
-            Iw = DI = DI ^ DI;
-            break;
-          default:
-            ret = -6;
-            NOTIMP("Ev=%02" PRIx8 "\n", Ev);
-            break;
-        }
-        if (Iw == 0) {
-          FL |= ZF;
-        } else {
-          FL &= (uint16_t)~ZF;
-        }
-        if (parity_odd16(Iw)) {
-          FL |= PF;
-        } else {
-          FL &= (uint16_t)~PF;
-        }
-        break;
-      // PC=fe0cd OPC=3B15
-      // 001110 1 1 00 010 101
-      // mod=0 reg=2 rm=5
-      // 000FE0CD  3B15              cmp    dx,WORD PTR [di],
-      case 0x3B: //	CMP		REG16,REG16/MEM16
-        mod = (opc[1] & 0xc0) >> 6;
-        reg = (opc[1] & 0x38) >> 3;
-        rm = opc[1] & 0x07;
-        mem = 0;
-        len = 2;
-        printf("CMP		REG16/MEM16,REG16\n");
-        switch (mod) {
-          case 0x0: // memory mode, no displacement follows except rm==6
-            switch (rm) {
-              case 0x5: //(di)
-                printf("USING SEG %s\n", x->def_seg == SEG_ES ? "ES" : "DS");
-                addr = (size_t)(x->def_seg == SEG_ES ? ES : DS) * 16 + DI;
-                memr(x, (void**)&mem, &len, addr);
-                if (!mem) {
-                  NOTIMP("Failed to acquire mem\n");
-                  return -1;
-                }
-                break;
-              default:
-                ret = -5;
-                NOTIMP("???? mod=%01" PRIx8 " reg=%01" PRIx8 " rm=%01" PRIx8
-                       "\n",
-                       mod,
-                       reg,
-                       rm);
-                break;
-            }
-            break;
-          default:
-            ret = -5;
-            NOTIMP("mod=%02" PRIx8 "\n", mod);
-            break;
-        }
-        if (mem) {
-          uint16_t regv;
-          switch (reg) {
-            case 0x2:
-              regv = DX;
-              break;
-            default:
-              ret = -5;
-              NOTIMP("???? mod=%01" PRIx8 " reg=%01" PRIx8 " rm=%01" PRIx8 "\n",
-                     mod,
-                     reg,
-                     rm);
-              break;
-          }
-          if (!ret) {
-            IP += 2;
-            if (*((uint16_t*)mem) == regv) {
-              FL |= ZF;
-            } else {
-              FL &= (uint16_t)~ZF;
-            }
-          }
-        } else {
-          ret = -1;
-          NOTIMP("!mem\n");
-          break;
+  for (int i = 0; i < 8; i++) {
+    if (p->isr & 1 << i) {
+      break;
+    }
+    if (p->irr & ~p->imr & 1 << i) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int
+pic_cascaded(xtem_t* x)
+{
+  return !x->pic[0].icw && !(x->pic[0].icw1 & ICW1_SNGL) &&
+         !x->pic[1].icw && x->pic[1].icw1;
+}
+
+// propagate the slave request to the master, and the master one to the CPU
+static void
+pic_update(xtem_t* x)
+{
+  pic_t* m = &x->pic[0];
+  if (pic_cascaded(x)) {
+    if (pic_pending(&x->pic[1]) >= 0) {
+      m->irr |= 1 << PIC_CASCADE;
+    } else {
+      m->irr &= (uint8_t)~(1 << PIC_CASCADE);
+    }
+  }
+  x->irq = !m->icw && pic_pending(m) >= 0;
+  ev_deadline(x);
+}
+
+// an edge on IRQ n, 8 to 15 are on the slave
+static void
+pic_irq(xtem_t* x, int n)
+{
+  x->pic[n >> 3].irr |= (uint8_t)(1 << (n & 7));
+  pic_update(x);
+}
+
+/* the CPU takes the interrupt request
+   return : its vector */
+static uint8_t
+pic_ack(xtem_t* x)
+{
+  pic_t* p = &x->pic[0];
+  int n = pic_pending(p);
+  if (n < 0) {
+    return (uint8_t)(p->vector + 7); // spurious
+  }
+  for (;;) {
+    p->irr &= (uint8_t) ~(1 << n);
+    if (!(p->icw4 & ICW4_AEOI)) {
+      p->isr |= (uint8_t)(1 << n);
+    }
+    if (p != x->pic || n != PIC_CASCADE || !pic_cascaded(x)) {
+      break;
+    }
+    p = &x->pic[1];
+    n = pic_pending(p);
+    if (n < 0) {
+      n = 7; // spurious
+      break;
+    }
+  }
+  pic_update(x);
+  return (uint8_t)(p->vector + n);
+}
+
+static uint16_t
+pic_in(void* user, uint16_t port, int size)
+{
+  xtem_t* x = user;
+  pic_t* p = &x->pic[port >> 7 & 1];
+  size = size;
+  if (port & 1) {
+    return p->imr;
+  }
+  return p->read_isr ? p->isr : p->irr;
+}
+
+static void
+pic_out(void* user, uint16_t port, uint16_t value, int size)
+{
+  xtem_t* x = user;
+  pic_t* p = &x->pic[port >> 7 & 1];
+  uint8_t v = (uint8_t)value;
+  size = size;
+  if (!(port & 1) && v & 0x10) { // ICW1
+    *p = (pic_t){ .icw1 = v, .icw = 2 };
+  } else if (!(port & 1) && v & 0x08) { // OCW3
+    if (v & 0x02) {
+      p->read_isr = v & 0x01;
+    }
+  } else if (!(port & 1)) { // OCW2
+    if ((v & 0xe0) == 0x60) { // specific EOI
+      p->isr &= (uint8_t) ~(1 << (v & 7));
+    } else if ((v & 0xe0) == 0x20) { // non specific EOI, of the highest
+      p->isr &= (uint8_t)(p->isr - 1);
+    }
+  } else if (p->icw == 2) {
+    p->vector = v & 0xf8;
+    p->icw = !(p->icw1 & ICW1_SNGL) ? 3 : p->icw1 & ICW1_ICW4 ? 4 : 0;
+  } else if (p->icw == 3) { // the cascade wiring is fixed
+    p->icw = p->icw1 & ICW1_ICW4 ? 4 : 0;
+  } else if (p->icw == 4) {
+    p->icw4 = v;
+    p->icw = 0;
+  } else { // OCW1
+    p->imr = v;
+  }
+  pic_update(x);
+}
+
+static uint64_t
+pit_period(const pit_chan_t* c)
+{
+  return c->reload ? c->reload : 0x10000;
+}
+
+// PIT clocks elapsed since the count was loaded
+static uint64_t
+pit_elapsed(xtem_t* x, const pit_chan_t* c)
+{
+  return (x->cycles - c->start) / PIT_CLOCK;
+}
+
+static uint16_t
+pit_count(xtem_t* x, const pit_chan_t* c)
+{
+  uint64_t n = pit_period(c);
+  uint64_t t = pit_elapsed(x, c);
+  if (!c->armed) {
+    return c->reload;
+  }
+  switch (c->mode) {
+    case 2:
+      return (uint16_t)(n - t % n);
+    case 3: // counts down by 2, twice per period
+      return (uint16_t)((n - 2 * t % n) & ~(uint64_t)1);
+    default:
+      return (uint16_t)(n - t);
+  }
+}
+
+static void
+pit_event(void* user, uint64_t now);
+
+// schedule the next IRQ 0 of channel 0, if any
+static void
+pit_schedule(xtem_t* x)
+{
+  pit_chan_t* c = &x->pit[0];
+  uint64_t n = pit_period(c);
+  uint64_t t = pit_elapsed(x, c);
+  if (!c->armed) {
+    ev_cancel(x, pit_event, x);
+  } else if (c->mode == 2 || c->mode == 3) {
+    ev_add(x, c->start + (t / n + 1) * n * PIT_CLOCK, pit_event, x);
+  } else if (t < n) { // terminal count, once
+    ev_add(x, c->start + n * PIT_CLOCK, pit_event, x);
+  } else {
+    ev_cancel(x, pit_event, x);
+  }
+}
+
+static void
+pit_event(void* user, uint64_t now)
+{
+  xtem_t* x = user;
+  now = now;
+  pic_irq(x, 0);
+  pit_schedule(x);
+}
+
+static uint16_t
+pit_in(void* user, uint16_t port, int size)
+{
+  xtem_t* x = user;
+  pit_chan_t* c = &x->pit[port & 3];
+  uint16_t v;
+  size = size;
+  if ((port & 3) == 3) {
+    return 0xff;
+  }
+  v = c->latched ? c->latch : pit_count(x, c);
+  if (c->rw == 3 && !c->rd_msb) {
+    c->rd_msb = 1;
+    return v & 0xff;
+  }
+  c->rd_msb = 0;
+  c->latched = 0;
+  return c->rw == 1 ? v & 0xff : v >> 8;
+}
+
+static void
+pit_out(void* user, uint16_t port, uint16_t value, int size)
+{
+  xtem_t* x = user;
+  uint8_t v = (uint8_t)value;
+  pit_chan_t* c;
+  size = size;
+  if ((port & 3) == 3) { // control word
+    c = &x->pit[v >> 6 & 3];
+    if ((v >> 6) == 3) {
+      return; // read back is 8254 only
+    }
+    if (!(v & 0x30)) { // counter latch
+      if (!c->latched) {
+        c->latch = pit_count(x, c);
+        c->latched = 1;
+      }
+      return;
+    }
+    c->rw = v >> 4 & 3;
+    c->mode = v >> 1 & 7;
+    c->mode = c->mode > 5 ? c->mode - 4 : c->mode; // 6, 7 are 2, 3
+    c->wr_msb = c->rd_msb = c->latched = 0;
+    c->armed = 0;
+  } else {
+    c = &x->pit[port & 3];
+    if (c->rw == 1) { // the other byte of the count is 0
+      c->reload = v;
+    } else if (c->rw == 2) {
+      c->reload = (uint16_t)(v << 8);
+    } else if (!c->wr_msb) {
+      c->reload = (uint16_t)((c->reload & 0xff00) | v);
+    } else {
+      c->reload = (uint16_t)((c->reload & 0xff) | v << 8);
+    }
+    if (c->rw == 3 && !c->wr_msb) {
+      c->wr_msb = 1;
+      if (c->mode == 0) {
+        c->armed = 0; // stops counting until the MSB
+      }
+    } else {
+      c->wr_msb = 0;
+      c->start = x->cycles;
+      c->armed = c->mode != 1 && c->mode != 5; // gate triggered
+    }
+  }
+  if (c == x->pit) {
+    pit_schedule(x);
+  }
+}
+
+static const libxtem_rom_t default_roms[] = {
+  //  { "bios", 0 },
+  { "bios64", 0 },
+  { 0, 0 },
+};
+
+static int
+xtem_cleanup(xtem_t* x);
+
+/* roms : terminated by a 0 file, 0 => default_roms
+   return : 0 if the memory or a ROM image couldn't be mapped */
+static xtem_t*
+xtem_init(const libxtem_rom_t* roms)
+{
+  xtem_t* x = calloc(1, sizeof(xtem_t));
+  xtem_reset(x);
+  x->stop = UINT64_MAX;
+  x->bp_hit = BC_NONE;
+  ev_deadline(x);
+  if (mem_init(x) < 0) {
+    xtem_cleanup(x);
+    return 0;
+  }
+  mem_map(x, RAM_FIRST, RAM_LAST, MEM_RAM);
+  for (roms = roms ? roms : default_roms; roms->file; roms++) {
+    if (xtem_load_rom(x, roms->file, roms->addr) < 0) {
+      xtem_cleanup(x);
+      return 0;
+    }
+  }
+  xtem_dev_add(x, 0, PORTS - 1, &(libxtem_dev_t){ .name = "none" });
+  xtem_dev_add(x,
+               0x20,
+               0x21,
+               &(libxtem_dev_t){
+                 .name = "pic", .user = x, .in = pic_in, .out = pic_out });
+  xtem_dev_add(x,
+               0x40,
+               0x43,
+               &(libxtem_dev_t){
+                 .name = "pit", .user = x, .in = pit_in, .out = pit_out });
+  x->bc = calloc(1, sizeof(bc_t));
+  for (int i = 0; i < BC_BLOCKS; i++) {
+    x->bc->block[i].pc = BC_NONE;
+  }
+#ifdef XTEM_JIT
+  x->jit = calloc(1, sizeof(jit_t));
+  x->jit->code = mmap(0,
+                      JIT_CODE_SIZE,
+                      PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+  if (x->jit->code == MAP_FAILED) {
+    perror("mmap jit code");
+    x->jit->code = 0; // interpret only
+  }
+#endif
+  return x;
+}
+
+static int
+xtem_cleanup(xtem_t* x)
+{
+  if (x) {
+    if (x->mem) {
+      munmap(x->mem, MEM_SIZE + HMA_SIZE);
+    }
+    if (x->bc) {
+      free(x->bc);
+    }
+#ifdef XTEM_JIT
+    if (x->jit) {
+      if (x->jit->code) {
+        munmap(x->jit->code, JIT_CODE_SIZE);
+      }
+      free(x->jit);
+    }
+#endif
+    if (x->trace.ring) {
+      free(x->trace.ring);
+    }
+    free(x->prof.pc);
+    free(x->prof.node);
+    free(x->prof.hash);
+    free(x);
+  }
+  return 0;
+}
+
+/* what unmapped memory reads as, plus a byte for the word accesses at
+   offset 0xfff, which callers don't split */
+static const uint8_t unmapped_page[PAGE_SIZE + 1] = { [0 ... PAGE_SIZE] =
+                                                        0xcc };
+
+/* end of the run of pages of the same type as the one holding addr,
+   stopping early once past addr + len */
+static size_t
+mem_end(xtem_t* x, size_t addr, size_t len)
+{
+  size_t p = addr >> PAGE_SHIFT;
+  size_t end = (p + 1) << PAGE_SHIFT;
+  while (end < addr + len && end < MEM_SIZE + HMA_SIZE &&
+         x->page[end >> PAGE_SHIFT] == x->page[p]) {
+    end += PAGE_SIZE;
+  }
+  return end;
+}
+
+/* start of the run of pages of the same type as the one holding addr,
+   stopping early once below addr - len */
+static size_t
+mem_begin(xtem_t* x, size_t addr, size_t len)
+{
+  size_t p = addr >> PAGE_SHIFT;
+  size_t begin = p << PAGE_SHIFT;
+  while (begin + len > addr && begin >= PAGE_SIZE &&
+         x->page[(begin >> PAGE_SHIFT) - 1] == x->page[p]) {
+    begin -= PAGE_SIZE;
+  }
+  return begin;
+}
+
+/*	read memory without side effects
+        caller expects a backdoor memory pointer in return
+        len is clipped to what the pointer covers
+*/
+static void
+memr(xtem_t* x, void** dest, size_t* len, size_t addr)
+{
+  size_t end;
+  if (addr < MEM_SIZE + HMA_SIZE &&
+      (x->page[addr >> PAGE_SHIFT] == MEM_RAM ||
+       x->page[addr >> PAGE_SHIFT] == MEM_ROM)) {
+    *dest = x->mem + addr;
+    end = mem_end(x, addr, *len);
+  } else {
+    *dest = (void*)(uintptr_t)(unmapped_page + (addr & (PAGE_SIZE - 1)));
+    end = (addr | (PAGE_SIZE - 1)) + 1;
+  }
+  if (addr + *len > end) {
+    *len = end - addr;
+  }
+}
+
+static void
+bc_drop(xtem_t* x, block_t* b)
+{
+  for (size_t p = b->pc >> PAGE_SHIFT; p <= (b->end - 1) >> PAGE_SHIFT; p++) {
+    x->bc->code[p]--;
+  }
+  b->pc = BC_NONE;
+#ifdef XTEM_JIT
+  b->jit = 0;
+#endif
+}
+
+/* forget the cached blocks overlapping page p, it is being written */
+static void
+bc_invalidate(xtem_t* x, size_t p)
+{
+  for (int i = 0; i < BC_BLOCKS && x->bc->code[p]; i++) {
+    block_t* b = &x->bc->block[i];
+    if (b->pc != BC_NONE && (b->pc >> PAGE_SHIFT) <= p &&
+        ((b->end - 1) >> PAGE_SHIFT) >= p) {
+      bc_drop(x, b);
+      x->bc->invalidations++;
+    }
+  }
+}
+
+static int
+bp_page(xtem_t* x, size_t addr)
+{
+  size_t p = addr >> PAGE_SHIFT;
+  return p < PAGES && (x->bp_map[p / 64] >> (p % 64) & 1);
+}
+
+static int
+bp_at(xtem_t* x, size_t addr)
+{
+  for (int i = 0; i < x->bps; i++) {
+    if (x->bp[i] == addr) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* whether to stop at pc, which is on a page with breakpoints : the first
+   instruction run after stopping at a breakpoint is that one */
+static int
+bp_stop(xtem_t* x, size_t pc)
+{
+  if (!bp_at(x, pc) ||
+      (pc == x->bp_hit && x->bc->insns == x->bp_insns)) {
+    return 0;
+  }
+  x->bp_hit = pc;
+  x->bp_insns = x->bc->insns;
+  return 1;
+}
+
+/* set or clear the breakpoint at linear address addr
+   return : <0 if out of range or BP_MAX are set */
+static int
+xtem_bp(xtem_t* x, size_t addr, int on)
+{
+  size_t p = addr >> PAGE_SHIFT;
+  int i;
+  int page = 0;
+  if (addr >= MEM_SIZE + HMA_SIZE) {
+    return -1;
+  }
+  for (i = 0; i < x->bps && x->bp[i] != addr; i++) {
+  }
+  if (on && i == x->bps) {
+    if (x->bps == BP_MAX) {
+      return -1;
+    }
+    x->bp[x->bps++] = (uint32_t)addr;
+  } else if (!on && i < x->bps) {
+    x->bp[i] = x->bp[--x->bps];
+  }
+  for (i = 0; i < x->bps; i++) {
+    page |= x->bp[i] >> PAGE_SHIFT == p;
+  }
+  x->bp_map[p / 64] &= ~((uint64_t)1 << (p % 64));
+  x->bp_map[p / 64] |= (uint64_t)page << (p % 64);
+  if (x->bc->code[p]) {
+    bc_invalidate(x, p); // refill the blocks with the breakpoints in mind
+  }
+  return 0;
+}
+
+// whether the len bytes at linear address addr are on pages with watches
+static int
+watch_page(xtem_t* x, size_t addr, size_t len)
+{
+  for (size_t p = addr >> PAGE_SHIFT; p <= (addr + len - 1) >> PAGE_SHIFT;
+       p++) {
+    size_t q = p % (MEM_SIZE >> PAGE_SHIFT);
+    if (x->watch_map[q / 64] >> (q % 64) & 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* the guest accesses (type WATCH_R or WATCH_W) len bytes at addr, with
+   x->watches set; the first hit is kept until reported */
+static void
+watch_access(xtem_t* x, size_t addr, size_t len, int type)
+{
+  if (!watch_page(x, addr, len)) {
+    return;
+  }
+  addr %= MEM_SIZE;
+  for (int i = 0; i < x->watches && !x->watch_hit.type; i++) {
+    const watch_t* w = &x->watch[i];
+    if ((w->type & type) && addr < (size_t)w->addr + w->len &&
+        addr + len > w->addr) {
+      x->watch_hit.addr = (uint32_t)(addr > w->addr ? addr : w->addr);
+      x->watch_hit.type = w->type;
+      ev_deadline(x);
+    }
+  }
+}
+
+/* set or clear the watchpoint on len bytes at addr, for accesses of type
+   return : <0 if out of range or WATCH_MAX are set */
+static int
+xtem_watch(xtem_t* x, size_t addr, size_t len, int type, int on)
+{
+  int i;
+  if (!len || addr >= MEM_SIZE + HMA_SIZE || len > MEM_SIZE) {
+    return -1;
+  }
+  addr %= MEM_SIZE;
+  for (i = 0; i < x->watches; i++) {
+    const watch_t* w = &x->watch[i];
+    if (w->addr == addr && w->len == len && w->type == type) {
+      break;
+    }
+  }
+  if (on && i == x->watches) {
+    if (x->watches == WATCH_MAX) {
+      return -1;
+    }
+    x->watch[x->watches++] = (watch_t){
+      .addr = (uint32_t)addr, .len = (uint32_t)len, .type = type
+    };
+  } else if (!on && i < x->watches) {
+    x->watch[i] = x->watch[--x->watches];
+  }
+  memset(x->watch_map, 0, sizeof(x->watch_map));
+  for (i = 0; i < x->watches; i++) {
+    const watch_t* w = &x->watch[i];
+    for (size_t p = w->addr >> PAGE_SHIFT;
+         p <= (w->addr + w->len - 1) >> PAGE_SHIFT;
+         p++) {
+      size_t q = p % (MEM_SIZE >> PAGE_SHIFT);
+      x->watch_map[q / 64] |= (uint64_t)1 << (q % 64);
+    }
+  }
+  return 0;
+}
+
+/* same as memr(), for writing : writes outside of RAM are dropped */
+static void
+memw(xtem_t* x, void** dest, size_t* len, size_t addr)
+{
+  size_t end;
+  if (addr >= MEM_SIZE + HMA_SIZE || x->page[addr >> PAGE_SHIFT] != MEM_RAM) {
+    *dest = x->sink + (addr & (PAGE_SIZE - 1));
+    end = (addr | (PAGE_SIZE - 1)) + 1;
+    if (addr + *len > end) {
+      *len = end - addr;
+    }
+    return;
+  }
+  *dest = x->mem + addr;
+  end = mem_end(x, addr, *len);
+  if (addr + *len > end) {
+    *len = end - addr;
+  }
+  for (size_t p = addr >> PAGE_SHIFT; p <= (addr + *len - 1) >> PAGE_SHIFT;
+       p++) {
+    // the HMA and the first 64 KiB are the same memory
+    size_t alias = p < HMA_SIZE >> PAGE_SHIFT ? p + (MEM_SIZE >> PAGE_SHIFT)
+                   : p >= MEM_SIZE >> PAGE_SHIFT ? p - (MEM_SIZE >> PAGE_SHIFT)
+                                                 : p;
+    size_t low = alias < p ? alias : p;
+    x->dirty[low / 64] |= (uint64_t)1 << (low % 64);
+    if (x->bc->code[p]) {
+      bc_invalidate(x, p);
+    }
+    if (alias != p && x->bc->code[alias]) {
+      bc_invalidate(x, alias);
+    }
+  }
+}
+
+/* copy n bytes of memory at addr, possibly across regions */
+static void
+mem_fetch(xtem_t* x, uint8_t* buf, size_t n, size_t addr)
+{
+  for (size_t i = 0; i < n;) {
+    uint8_t* p = 0;
+    size_t len = n - i;
+    memr(x, (void**)&p, &len, addr + i);
+    memcpy(buf + i, p, len);
+    i += len;
+  }
+}
+
+// mem_fetch() counterpart, writes to ROM or unmapped pages are dropped
+static void
+mem_store(xtem_t* x, const uint8_t* buf, size_t n, size_t addr)
+{
+  for (size_t i = 0; i < n;) {
+    uint8_t* p = 0;
+    size_t len = n - i;
+    memw(x, (void**)&p, &len, addr + i);
+    memcpy(p, buf + i, len);
+    i += len;
+  }
+}
+
+#define CMPRANGE(p, a, b) ((port >= a) && (port <= b))
+#define CMPRANGE0(p, a) (port == a)
+char*
+hint_out0(int port, int data)
+{
+  data = data;
+  return CMPRANGE(port, 0x0000, 0x001F)
+           ? "The first legacy DMA controller, often used for transfers to "
+             "floppies."
+         : CMPRANGE(port, 0x0020, 0x0021)
+           ? "The first Programmable Interrupt Controller"
+         : CMPRANGE(port, 0x0022, 0x0023)
+           ? "Access to the Model-Specific Registers of Cyrix processors."
+         : CMPRANGE(port, 0x0040, 0x0047)
+           ? "The PIT (Programmable Interval Timer)"
+         : CMPRANGE(port, 0x0060, 0x0064)
+           ? "The '8042' PS/2 Controller or its predecessors, dealing with "
+             "keyboards and mice."
+         : CMPRANGE(port, 0x0070, 0x0071) ? "The CMOS and RTC registers"
+         : CMPRANGE(port, 0x0080, 0x008F) ? "The DMA (Page registers)"
+         : CMPRANGE0(port, 0x0092)
+           ? "The location of the fast A20 gate register"
+         : CMPRANGE(port, 0x00A0, 0x00A1) ? "The second PIC"
+         : CMPRANGE(port, 0x00C0, 0x00DF)
+           ? "The second DMA controller, often used for soundblasters"
+         : CMPRANGE0(port, 0x00E9)
+           ? "Home of the Port E9 Hack. Used on some emulators to directly "
+             "send text to the hosts' console."
+         : CMPRANGE(port, 0x0170, 0x0177)
+           ? "The secondary ATA harddisk controller."
+         : CMPRANGE(port, 0x01F0, 0x01F7)
+           ? "The primary ATA harddisk controller."
+         : CMPRANGE(port, 0x0278, 0x027A) ? "Parallel port"
+         : CMPRANGE(port, 0x02F8, 0x02FF) ? "Second serial port"
+         : CMPRANGE(port, 0x03B0, 0x03DF)
+           ? "The range used for the IBM VGA, its direct predecessors, as well "
+             "as any modern video card in legacy mode."
+         : CMPRANGE(port, 0x03F0, 0x03F7) ? "Floppy disk controller"
+         : CMPRANGE(port, 0x03F8, 0x03FF) ? "First serial port"
+                                          : "???";
+}
+char*
+hint_out(int port, int data)
+{
+  data = data;
+  return CMPRANGE(port, 0x0000, 0x001F)
+           ? "first legacy DMA controller, floppies"
+         : CMPRANGE(port, 0x0020, 0x0021)
+           ? "first Programmable Interrupt Controller"
+         : CMPRANGE(port, 0x0022, 0x0023)
+           ? "Model-Specific Registers of Cyrix processors"
+         : CMPRANGE(port, 0x0040, 0x0047) ? "PIT (Programmable Interval Timer)"
+         : CMPRANGE(port, 0x0060, 0x0064)
+           ? "'8042' PS/2 Controller, keyboards and mice"
+         : CMPRANGE(port, 0x0070, 0x0071) ? "CMOS and RTC registers"
+         : CMPRANGE(port, 0x0080, 0x008F) ? "DMA (Page registers)"
+         : CMPRANGE0(port, 0x0092)        ? "fast A20 gate register"
+         : CMPRANGE(port, 0x00A0, 0x00A1) ? "second PIC"
+         : CMPRANGE(port, 0x00C0, 0x00DF)
+           ? "second DMA controller, soundblasters"
+         : CMPRANGE0(port, 0x00E9)        ? "Port E9 Hack"
+         : CMPRANGE(port, 0x0170, 0x0177) ? "secondary ATA harddisk controller"
+         : CMPRANGE(port, 0x01F0, 0x01F7) ? "primary ATA harddisk controller"
+         : CMPRANGE(port, 0x0278, 0x027A) ? "Parallel port"
+         : CMPRANGE(port, 0x02F8, 0x02FF) ? "Second serial port"
+         : CMPRANGE(port, 0x03B0, 0x03DF) ? "VGA"
+         : CMPRANGE(port, 0x03F0, 0x03F7) ? "Floppy disk controller"
+         : CMPRANGE(port, 0x03F8, 0x03FF) ? "First serial port"
+                                          : "???";
+}
+
+/* operand forms, as spelled in 8086_table.txt
+   register forms are in encoding order, so that A_AL + n is reg8 n, etc. */
+enum
+{
+  A_NONE,
+  A_Eb,
+  A_Ev,
+  A_Ew,
+  A_Gb,
+  A_Gv,
+  A_Sw,
+  A_M,
+  A_Mp,
+  A_Ib,
+  A_Iv,
+  A_Iw,
+  A_I0,
+  A_Jb,
+  A_Jv,
+  A_Ap,
+  A_Ob,
+  A_Ov,
+  A_1,
+  A_3,
+  A_DX,
+  A_AL,
+  A_CL,
+  A_DL,
+  A_BL,
+  A_AH,
+  A_CH,
+  A_DH,
+  A_BH,
+  A_eAX,
+  A_eCX,
+  A_eDX,
+  A_eBX,
+  A_eSP,
+  A_eBP,
+  A_eSI,
+  A_eDI,
+  A_ES,
+  A_CS,
+  A_SS,
+  A_DS,
+};
+
+#define OPF_W 0x01     // word operands
+#define OPF_MODRM 0x02 // a ModR/M byte follows the opcode
+#define OPF_JUMP 0x04  // may transfer control, ends a decoded block
+#define JCC_TAKEN 12   // clocks on top of the not taken ones
+
+typedef struct op_s op_t;
+// same return values as step()
+enum
+{
+  RET_OK = 0,
+  RET_PREFIX = 1,
+  RET_ERROR = -1, // a memory operand couldn't be accessed
+  RET_NOTIMP = -2,
+  RET_HLT = -3,
+  RET_BREAK = -4, // INT 3, or a breakpoint
+  RET_IO = -5,    // port I/O exit, see x->io
+  RET_WATCH = -6, // after a watched access, see x->watch_hit
+};
+typedef int (*op_fn_t)(xtem_t* x, const op_t* op, uint8_t* opc);
+struct op_s
+{
+  const char* name;
+  op_fn_t fn;
+  uint8_t a[2];    // operand forms
+  uint8_t flags;   // OPF_*
+  uint8_t imm;     // immediate bytes
+  const op_t* grp; // GRPn sub-table, indexed by ModR/M reg
+  uint8_t cycles[2]; // clocks of the register and memory forms, but for EA
+};
+
+/* one ModR/M byte, see gen_table.py */
+typedef struct
+{
+  uint8_t mod, reg, rm;
+  uint8_t disp;  // displacement bytes
+  uint8_t base;  // base register, 8 => none
+  uint8_t index; // index register, 8 => none
+  uint8_t ss;    // BP based, SS is the default segment
+  uint8_t ea;    // effective address clocks
+} modrm_t;
+
+static const modrm_t modrm_table[256];
+
+static uint16_t*
+reg16(xtem_t* x, int n)
+{
+  return &x->r[n].w;
+}
+
+static uint8_t*
+reg8(xtem_t* x, int n)
+{
+  return n < 4 ? &x->r[n].b.l : &x->r[n - 4].b.h;
+}
+
+static uint16_t*
+sreg(xtem_t* x, int n)
+{
+  switch (n & 3) {
+    case 0:
+      return &ES;
+    case 1:
+      return &CS;
+    case 2:
+      return &SS;
+    default:
+      return &DS;
+  }
+}
+
+static int
+op_notimp(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  NOTIMP("PC=%05" PRIx32 " OPC=%02" PRIx8 " %02" PRIx8 " %02" PRIx8
+         " %02" PRIx8 " (%s)\n",
+         (uint32_t)((size_t)CS * 16 + IP),
+         opc[0],
+         opc[1],
+         opc[2],
+         opc[3],
+         op->name);
+  return RET_NOTIMP;
+}
+
+static int
+op_grp(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  const op_t* sub = &op->grp[(opc[1] & 0x38) >> 3];
+  return sub->fn(x, sub, opc);
+}
+
+static int
+op_segpfx(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  if (x->def_seg == SEG_NONE && x->def_rep == REP_NOT) {
+    x->pfx_ip = IP;
+  }
+  IP++;
+  x->def_seg = SEG_ES + ((opc[0] >> 3) & 3);
+  return 1;
+}
+
+static int
+op_rep(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  if (x->def_seg == SEG_NONE && x->def_rep == REP_NOT) {
+    x->pfx_ip = IP;
+  }
+  IP++;
+  x->def_rep = opc[0] == 0xF2 ? REP_REPNZ : REP_REPZ;
+  return 1;
+}
+
+/* lazy flags
+   ALU instructions only record their operands and result in x->lf, and
+   OF SF ZF AF PF CF are computed from them when actually read */
+static const uint8_t parity_table[256];
+
+static int
+lf_cf(xtem_t* x)
+{
+  switch (x->lf.op) {
+    case LF_ADD:
+    case LF_SUB:
+      return !!(x->lf.r & (x->lf.w ? 0x10000 : 0x100));
+    case LF_LOGIC:
+      return 0;
+    default: // INC and DEC preserve CF
+      return !!(FL & CF);
+  }
+}
+
+static int
+lf_zf(xtem_t* x)
+{
+  if (x->lf.op == LF_NONE) {
+    return !!(FL & ZF);
+  }
+  return !(x->lf.r & (x->lf.w ? 0xffff : 0xff));
+}
+
+static int
+lf_sf(xtem_t* x)
+{
+  if (x->lf.op == LF_NONE) {
+    return !!(FL & SF);
+  }
+  return !!(x->lf.r & (x->lf.w ? 0x8000 : 0x80));
+}
+
+static int
+lf_of(xtem_t* x)
+{
+  uint32_t a = x->lf.a, b = x->lf.b, r = x->lf.r;
+  uint32_t sign = x->lf.w ? 0x8000 : 0x80;
+  switch (x->lf.op) {
+    case LF_ADD:
+    case LF_INC:
+      return !!(~(a ^ b) & (a ^ r) & sign);
+    case LF_SUB:
+    case LF_DEC:
+      return !!((a ^ b) & (a ^ r) & sign);
+    case LF_LOGIC:
+      return 0;
+    default:
+      return !!(FL & OF);
+  }
+}
+
+static int
+lf_pf(xtem_t* x)
+{
+  if (x->lf.op == LF_NONE) {
+    return !!(FL & PF);
+  }
+  return !!parity_table[x->lf.r & 0xff];
+}
+
+static int
+lf_af(xtem_t* x)
+{
+  switch (x->lf.op) {
+    case LF_NONE:
+      return !!(FL & AF);
+    case LF_LOGIC:
+      return 0;
+    default:
+      return !!((x->lf.a ^ x->lf.b ^ x->lf.r) & 0x10);
+  }
+}
+
+/* materialize FL, for whoever reads it as a whole (PUSHF, LAHF, INT, RSP) */
+static uint16_t
+flags_get(xtem_t* x)
+{
+  if (x->lf.op != LF_NONE) {
+    uint16_t fl = FL & (uint16_t)~(OF | SF | ZF | AF | PF | CF);
+    fl |= (uint16_t)(lf_of(x) ? OF : 0);
+    fl |= (uint16_t)(lf_sf(x) ? SF : 0);
+    fl |= (uint16_t)(lf_zf(x) ? ZF : 0);
+    fl |= (uint16_t)(lf_af(x) ? AF : 0);
+    fl |= (uint16_t)(lf_pf(x) ? PF : 0);
+    fl |= (uint16_t)(lf_cf(x) ? CF : 0);
+    FL = fl;
+    x->lf.op = LF_NONE;
+  }
+  return FL;
+}
+
+/* overwrite FL as a whole (POPF, SAHF, IRET, RSP) */
+static void
+flags_set(xtem_t* x, uint16_t fl)
+{
+  FL = fl;
+  x->lf.op = LF_NONE;
+}
+
+static trace_rec_t*
+trace_rec(xtem_t* x, int type)
+{
+  uint64_t h = atomic_load_explicit(&x->trace.head, memory_order_relaxed);
+  trace_rec_t* t = &x->trace.ring[h & (TRACE_RECS - 1)];
+  // before overwriting the slot, see libxtem_trace_dump()
+  atomic_store_explicit(&x->trace.wr, h, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  t->type = (uint8_t)type;
+  return t;
+}
+
+static void
+trace_publish(xtem_t* x)
+{
+  atomic_fetch_add_explicit(&x->trace.head, 1, memory_order_release);
+}
+
+static void
+trace_regs_get(xtem_t* x, uint16_t* r)
+{
+  for (int i = 0; i < 8; i++) {
+    r[i] = x->r[i].w;
+  }
+  for (int i = 0; i < 4; i++) {
+    r[8 + i] = *sreg(x, i);
+  }
+  r[12] = flags_get(x);
+}
+
+/* an instruction is about to run at pc */
+static void
+trace_insn(xtem_t* x, size_t pc, const uint8_t* b)
+{
+  trace_rec_t* t = trace_rec(x, TR_INSN);
+  t->addr = (uint32_t)pc;
+  t->v = CS;
+  memcpy(t->b, b, INSN_LEN);
+  trace_publish(x);
+  if (TRACE(x, LIBXTEM_TRACE_REGS)) {
+    trace_regs_get(x, x->trace.r);
+  }
+}
+
+/* the registers the instruction changed */
+static void
+trace_regs(xtem_t* x)
+{
+  uint16_t r[TRACE_NREGS];
+  trace_regs_get(x, r);
+  for (int i = 0; i < TRACE_NREGS; i++) {
+    if (r[i] != x->trace.r[i]) {
+      trace_rec_t* t = trace_rec(x, TR_REG);
+      t->n = (uint8_t)i;
+      t->v = r[i];
+      t->addr = x->trace.r[i];
+      trace_publish(x);
+    }
+  }
+}
+
+static void
+trace_mem(xtem_t* x, int type, size_t addr, int w, const void* p)
+{
+  trace_rec_t* t = trace_rec(x, type);
+  t->n = w ? 2 : 1;
+  t->addr = (uint32_t)addr;
+  t->v = type == TR_MEMR ? (w ? *(const uint16_t*)p : *(const uint8_t*)p) : 0;
+  trace_publish(x);
+}
+
+static void
+trace_io(xtem_t* x, int type, uint16_t port, uint16_t v, int size)
+{
+  trace_rec_t* t = trace_rec(x, type);
+  t->n = (uint8_t)size;
+  t->addr = port;
+  t->v = v;
+  trace_publish(x);
+}
+
+/* enter the calling context of the current CS:IP, under the current one */
+static void
+prof_call(xtem_t* x)
+{
+  prof_t* p = &x->prof;
+  uint32_t addr = (uint32_t)((size_t)CS * 16 + IP);
+  size_t h = ((addr * 0x9e3779b1u) ^ p->cur) & (PROF_HASH - 1);
+  if (p->lost || p->node[p->cur].depth >= PROF_DEPTH) {
+    p->lost++;
+    return;
+  }
+  for (; p->hash[h]; h = (h + 1) & (PROF_HASH - 1)) {
+    const prof_node_t* n = &p->node[p->hash[h]];
+    if (n->parent == p->cur && n->addr == addr) {
+      p->cur = p->hash[h];
+      return;
+    }
+  }
+  if (p->nodes == PROF_NODES) {
+    p->lost++;
+    return;
+  }
+  p->node[p->nodes] = (prof_node_t){
+    .addr = addr,
+    .parent = p->cur,
+    .depth = (uint16_t)(p->node[p->cur].depth + 1),
+  };
+  p->hash[h] = (uint16_t)p->nodes;
+  p->cur = (uint16_t)p->nodes++;
+}
+
+// back to the caller's context, a RET at the outermost one stays there
+static void
+prof_ret(xtem_t* x)
+{
+  prof_t* p = &x->prof;
+  if (p->lost) {
+    p->lost--;
+  } else {
+    p->cur = p->node[p->cur].parent;
+  }
+}
+
+/* the instruction at pc ran, its handler returned ret
+   hardware interrupts enter their context in xtem_poll() */
+static void
+prof_insn(xtem_t* x, size_t pc, const uint8_t* b, int ret)
+{
+  prof_t* p = &x->prof;
+  p->pc[pc]++;
+  p->op[b[0]]++;
+  p->node[p->cur].count++;
+  if (ret < 0) {
+    return;
+  }
+  switch (b[0]) {
+    case 0xe8: // CALL Jv
+    case 0x9a: // CALL Ap
+    case 0xcd: // INT Ib
+      prof_call(x);
+      break;
+    case 0xff: // GRP5/2 CALL Ev, GRP5/3 CALL Mp
+      if ((b[1] & 0x30) == 0x10) {
+        prof_call(x);
+      }
+      break;
+    case 0xc2: // RET Iw
+    case 0xc3: // RET
+    case 0xca: // RETF Iw
+    case 0xcb: // RETF
+    case 0xcf: // IRET
+      prof_ret(x);
+      break;
+  }
+}
+static void
+lf_record(xtem_t* x, int op, int w, uint16_t a, uint16_t b, uint32_t r)
+{
+  x->lf.op = (uint8_t)op;
+  x->lf.w = (uint8_t)w;
+  x->lf.a = a;
+  x->lf.b = b;
+  x->lf.r = r;
+}
+
+/* ALU operation, in opcode (and GRP1 reg) order
+   computes the result of a OP b and records it for the flags,
+   CMP doesn't write back */
+static uint16_t
+alu(xtem_t* x, int kind, int w, uint16_t a, uint16_t b)
+{
+  uint32_t r;
+  switch (kind) {
+    case 0x0: // ADD
+    case 0x2: // ADC
+      r = (uint32_t)a + b + (uint32_t)(kind == 0x2 ? lf_cf(x) : 0);
+      lf_record(x, LF_ADD, w, a, b, r);
+      break;
+    case 0x3: // SBB
+    case 0x5: // SUB
+    case 0x7: // CMP
+      r = (uint32_t)a - b - (uint32_t)(kind == 0x3 ? lf_cf(x) : 0);
+      lf_record(x, LF_SUB, w, a, b, r);
+      break;
+    case 0x1: // OR
+      r = a | b;
+      lf_record(x, LF_LOGIC, w, a, b, r);
+      break;
+    case 0x4: // AND
+      r = a & b;
+      lf_record(x, LF_LOGIC, w, a, b, r);
+      break;
+    default: // XOR
+      r = a ^ b;
+      lf_record(x, LF_LOGIC, w, a, b, r);
+      break;
+  }
+  return (uint16_t)(r & (w ? 0xffff : 0xff));
+}
+
+/* effective address of a ModR/M operand
+   p is the register for mod=3, else addr is the linear address */
+typedef struct
+{
+  const modrm_t* m;
+  void* p;
+  size_t addr;
+  uint16_t ofs;
+  uint8_t len; // ModR/M + displacement bytes
+} ea_t;
+
+static void
+ea_decode(xtem_t* x, const uint8_t* modrm, int w, ea_t* ea)
+{
+  const modrm_t* m = &modrm_table[modrm[0]];
+  uint16_t ofs = 0;
+  uint16_t seg;
+  ea->m = m;
+  ea->len = (uint8_t)(1 + m->disp);
+  if (m->mod == 0x3) {
+    ea->p = w ? (void*)reg16(x, m->rm) : (void*)reg8(x, m->rm);
+    return;
+  }
+  ea->p = 0;
+  if (m->disp == 1) {
+    ofs = (uint16_t)(int8_t)modrm[1];
+  } else if (m->disp == 2) {
+    ofs = *(uint16_t*)(modrm + 1);
+  }
+  if (m->base < 8) {
+    ofs = (uint16_t)(ofs + x->r[m->base].w);
+  }
+  if (m->index < 8) {
+    ofs = (uint16_t)(ofs + x->r[m->index].w);
+  }
+  if (x->def_seg) {
+    seg = *sreg(x, (int)x->def_seg - SEG_ES);
+  } else {
+    seg = m->ss ? SS : DS;
+  }
+  ea->ofs = ofs;
+  ea->addr = (size_t)seg * 16 + ofs;
+}
+
+/* host pointer to a decoded operand, through memw() when wr */
+static void*
+ea_ptr(xtem_t* x, ea_t* ea, int w, int wr)
+{
+  void* mem = 0;
+  size_t len = w ? 2 : 1;
+  if (ea->p) {
+    return ea->p;
+  }
+  if (wr) {
+    memw(x, &mem, &len, ea->addr);
+  } else {
+    memr(x, &mem, &len, ea->addr);
+  }
+  if (x->watches) {
+    watch_access(x, ea->addr, w ? 2 : 1, wr ? WATCH_W : WATCH_R);
+  }
+  if (!mem) {
+    NOTIMP("Failed to acquire mem\n");
+  } else if (TRACE(x, LIBXTEM_TRACE_MEM)) {
+    trace_mem(x, wr ? TR_MEMW : TR_MEMR, ea->addr, w, mem);
+  }
+  return mem;
+}
+
+static uint16_t
+rd(const void* p, int w)
+{
+  return w ? *(const uint16_t*)p : *(const uint8_t*)p;
+}
+
+static void
+wr(void* p, int w, uint16_t v)
+{
+  if (w) {
+    *(uint16_t*)p = v;
+  } else {
+    *(uint8_t*)p = (uint8_t)v;
+  }
+}
+
+static int
+op_alu(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  int w = op->flags & OPF_W;
+  int kind = (opc[0] >> 3) & 7;
+  ea_t ea = { 0 };
+  void* d;
+  void* s = 0;
+  uint16_t imm = 0;
+  uint16_t r;
+  if (op->flags & OPF_MODRM) {
+    ea_decode(x, opc + 1, w, &ea);
+  }
+  if ((opc[0] & 0xfc) == 0x80) {
+    // GRP1 Eb Ib, Ev Iv, Ev Ib (sign-extended)
+    kind = ea.m->reg;
+  }
+  if (op->imm == 2) {
+    imm = *(uint16_t*)(opc + 1 + ea.len);
+  } else if (op->imm == 1) {
+    imm = w ? (uint16_t)(int8_t)opc[1 + ea.len] : opc[1 + ea.len];
+  }
+  switch (op->a[0]) {
+    case A_AL:
+    case A_eAX:
+      d = &AX;
+      break;
+    case A_Gb:
+    case A_Gv:
+      d = w ? (void*)reg16(x, ea.m->reg) : (void*)reg8(x, ea.m->reg);
+      s = ea_ptr(x, &ea, w, 0);
+      break;
+    default: // E
+      d = ea_ptr(x, &ea, w, kind != 0x7);
+      if (op->a[1] == A_Gb || op->a[1] == A_Gv) {
+        s = w ? (void*)reg16(x, ea.m->reg) : (void*)reg8(x, ea.m->reg);
+      }
+      break;
+  }
+  if (!d || ((op->a[1] == A_Eb || op->a[1] == A_Ev) && !s)) {
+    return RET_ERROR;
+  }
+  r = alu(x, kind, w, rd(d, w), s ? rd(s, w) : imm);
+  if (kind != 0x7) {
+    wr(d, w, r);
+  }
+  IP = (uint16_t)(IP + 1 + ea.len + op->imm);
+  return 0;
+}
+
+static int
+op_incdec(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  int w = op->flags & OPF_W;
+  ea_t ea = { 0 };
+  void* d;
+  uint16_t v;
+  int dec;
+  if (op->a[0] >= A_eAX && op->a[0] <= A_eDI) {
+    d = reg16(x, op->a[0] - A_eAX);
+    dec = opc[0] & 0x8;
+  } else {
+    ea_decode(x, opc + 1, w, &ea);
+    dec = ea.m->reg & 0x1;
+    d = ea_ptr(x, &ea, w, 1);
+    if (!d) {
+      return RET_ERROR;
+    }
+  }
+  // CF is preserved : settle it in FL before the lazy flags take over
+  FL = (uint16_t)((FL & ~CF) | (lf_cf(x) ? CF : 0));
+  v = rd(d, w);
+  if (dec) {
+    lf_record(x, LF_DEC, w, v, 1, (uint32_t)v - 1);
+  } else {
+    lf_record(x, LF_INC, w, v, 1, (uint32_t)v + 1);
+  }
+  wr(d, w, (uint16_t)(dec ? v - 1 : v + 1));
+  IP = (uint16_t)(IP + 1 + ea.len);
+  return 0;
+}
+
+static int
+op_mov(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  int w = op->flags & OPF_W;
+  ea_t ea = { 0 };
+  void* d = 0;
+  void* s = 0;
+  uint16_t v;
+  if (op->a[0] >= A_AL && op->a[0] <= A_BH && op->a[1] == A_Ib) {
+    IP += 2;
+    *reg8(x, op->a[0] - A_AL) = opc[1];
+    return 0;
+  }
+  if (op->a[0] >= A_eAX && op->a[0] <= A_eDI && op->a[1] == A_Iv) {
+    IP += 3;
+    *reg16(x, op->a[0] - A_eAX) = *(uint16_t*)(opc + 1);
+    return 0;
+  }
+  if (op->a[0] == A_Ob || op->a[0] == A_Ov || op->a[1] == A_Ob ||
+      op->a[1] == A_Ov) {
+    // A0..A3 : AL/AX from/to [disp16], same as ModR/M 0x06
+    uint8_t modrm[3] = { 0x06, opc[1], opc[2] };
+    ea_decode(x, modrm, w, &ea);
+    if (op->a[0] == A_AL || op->a[0] == A_eAX) {
+      d = &AX;
+      s = ea_ptr(x, &ea, w, 0);
+    } else {
+      d = ea_ptr(x, &ea, w, 1);
+      s = &AX;
+    }
+    if (!d || !s) {
+      return RET_ERROR;
+    }
+    wr(d, w, rd(s, w));
+    IP += 3;
+    return 0;
+  }
+  ea_decode(x, opc + 1, w, &ea);
+  switch (op->a[0]) {
+    case A_Sw:
+      s = ea_ptr(x, &ea, 1, 0);
+      if (!s) {
+        return RET_ERROR;
+      }
+      v = *(uint16_t*)s;
+      *sreg(x, ea.m->reg) = v;
+      break;
+    case A_Ew:
+      d = ea_ptr(x, &ea, 1, 1);
+      if (!d) {
+        return RET_ERROR;
+      }
+      *(uint16_t*)d = *sreg(x, ea.m->reg);
+      break;
+    case A_Gb:
+    case A_Gv:
+      s = ea_ptr(x, &ea, w, 0);
+      if (!s) {
+        return RET_ERROR;
+      }
+      wr(w ? (void*)reg16(x, ea.m->reg) : (void*)reg8(x, ea.m->reg),
+         w,
+         rd(s, w));
+      break;
+    default: // E
+      d = ea_ptr(x, &ea, w, 1);
+      if (!d) {
+        return RET_ERROR;
+      }
+      if (op->a[1] == A_Ib || op->a[1] == A_Iv) {
+        v = w ? *(uint16_t*)(opc + 1 + ea.len) : opc[1 + ea.len];
+      } else {
+        v = rd(w ? (void*)reg16(x, ea.m->reg) : (void*)reg8(x, ea.m->reg), w);
+      }
+      wr(d, w, v);
+      break;
+  }
+  IP = (uint16_t)(IP + 1 + ea.len + op->imm);
+  return 0;
+}
+
+static int
+op_lea(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  ea_t ea = { 0 };
+  ea_decode(x, opc + 1, 1, &ea);
+  if (ea.p) {
+    return op_notimp(x, op, opc);
+  }
+  *reg16(x, ea.m->reg) = ea.ofs;
+  IP = (uint16_t)(IP + 1 + ea.len);
+  return 0;
+}
+
+static int
+op_jcc(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  int cc;
+  op = op;
+  IP += 2;
+  switch ((opc[0] & 0xf) >> 1) {
+    case 0x0: // JO
+      cc = lf_of(x);
+      break;
+    case 0x1: // JB
+      cc = lf_cf(x);
+      break;
+    case 0x2: // JZ
+      cc = lf_zf(x);
+      break;
+    case 0x3: // JBE
+      cc = lf_cf(x) || lf_zf(x);
+      break;
+    case 0x4: // JS
+      cc = lf_sf(x);
+      break;
+    case 0x5: // JPE
+      cc = lf_pf(x);
+      break;
+    case 0x6: // JL
+      cc = lf_sf(x) != lf_of(x);
+      break;
+    default: // JLE
+      cc = lf_zf(x) || lf_sf(x) != lf_of(x);
+      break;
+  }
+  if (cc != (opc[0] & 1)) {
+    IP = (uint16_t)(IP + (int8_t)opc[1]);
+    x->cycles += JCC_TAKEN;
+  }
+  return 0;
+}
+
+static int
+op_nop(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  return 0;
+}
+
+/* string instructions
+   REP spans are done in chunks, each contiguous in host memory : not
+   wrapping around 64 KiB in either segment, and in a single run of RAM
+   (or ROM, when only read) pages. A chunk is done at once with bulk
+   kernels, and what can't be (wraps, other regions) element by element. */
+enum
+{
+  STR_MOVS = 2, // A4 >> 1 & 7
+  STR_CMPS,
+  STR_STOS = 5,
+  STR_LODS,
+  STR_SCAS,
+};
+
+// clocks of a REP iteration, of bytes and words
+static const uint8_t str_rep_cycles[8][2] = {
+  [STR_MOVS] = { 17, 25 }, [STR_CMPS] = { 22, 30 }, [STR_STOS] = { 10, 14 },
+  [STR_LODS] = { 13, 17 }, [STR_SCAS] = { 15, 19 },
+};
+
+// an element at seg:ofs, a word wraps around within the segment
+static uint16_t
+str_rd(xtem_t* x, uint16_t seg, uint16_t ofs, int w)
+{
+  uint8_t b[2] = { 0 };
+  for (int i = 0; i <= w; i++) {
+    size_t addr = (size_t)seg * 16 + (uint16_t)(ofs + i);
+    mem_fetch(x, &b[i], 1, addr);
+    if (x->watches) {
+      watch_access(x, addr, 1, WATCH_R);
+    }
+  }
+  return (uint16_t)(b[0] | b[1] << 8);
+}
+
+static void
+str_wr(xtem_t* x, uint16_t seg, uint16_t ofs, int w, uint16_t v)
+{
+  for (int i = 0; i <= w; i++) {
+    uint8_t* p = 0;
+    size_t len = 1;
+    size_t addr = (size_t)seg * 16 + (uint16_t)(ofs + i);
+    memw(x, (void**)&p, &len, addr);
+    *p = (uint8_t)(v >> 8 * i);
+    if (x->watches) {
+      watch_access(x, addr, 1, WATCH_W);
+    }
+  }
+}
+
+/* how many of the n elements of size d at seg:ofs, in the DF direction,
+   are in one contiguous chunk; *lo is the linear address of its lowest */
+static size_t
+str_span(xtem_t* x, uint16_t seg, uint16_t ofs, size_t d, size_t n, int wr,
+         size_t* lo)
+{
+  size_t addr = (size_t)seg * 16 + ofs;
+  int type = x->page[addr >> PAGE_SHIFT];
+  size_t max;
+  if ((type != MEM_RAM && (wr || type != MEM_ROM)) || ofs + d > 0x10000 ||
+      x->page[(addr + d - 1) >> PAGE_SHIFT] != type) {
+    return 0;
+  }
+  if (!(FL & DF)) {
+    max = (0x10000 - ofs) / d;
+    if ((mem_end(x, addr, n * d) - addr) / d < max) {
+      max = (mem_end(x, addr, n * d) - addr) / d;
+    }
+  } else {
+    max = ofs / d + 1;
+    if ((addr - mem_begin(x, addr, n * d)) / d + 1 < max) {
+      max = (addr - mem_begin(x, addr, n * d)) / d + 1;
+    }
+  }
+  if (n > max) {
+    n = max;
+  }
+  *lo = FL & DF ? addr - (n - 1) * d : addr;
+  if (x->watches && watch_page(x, *lo, n * d)) {
+    return 0; // element by element, through str_rd() and str_wr()
+  }
+  return n;
+}
+
+// element i of a chunk of n, in processing order
+static uint16_t
+str_at(xtem_t* x, const uint8_t* p, size_t i, size_t n, int w)
+{
+  size_t k = FL & DF ? n - 1 - i : i;
+  return w ? (uint16_t)(p[2 * k] | p[2 * k + 1] << 8) : p[k];
+}
+
+/* do up to n elements in bulk
+   return : the elements done, 0 => do one element by element
+   *stop is set when a CMPS/SCAS condition ends the REP */
+static size_t
+str_bulk(xtem_t* x, int kind, int w, uint16_t seg, size_t n, int* stop)
+{
+  size_t d = w ? 2 : 1;
+  size_t slo = 0, dlo = 0;
+  uint8_t* sp;
+  uint8_t* dp;
+  size_t len;
+  size_t done = n;
+  if (kind != STR_STOS && kind != STR_SCAS) {
+    n = str_span(x, seg, SI, d, n, 0, &slo);
+  }
+  if (n && kind != STR_LODS) {
+    n = str_span(x, ES, DI, d, n, kind == STR_MOVS || kind == STR_STOS, &dlo);
+  }
+  if (!n) {
+    return 0;
+  }
+  if (FL & DF) {
+    // the source chunk may have got shorter
+    slo = (size_t)seg * 16 + SI - (n - 1) * d;
+  }
+  len = n * d;
+  if (kind == STR_MOVS || kind == STR_STOS) {
+    memw(x, (void**)&dp, &len, dlo); // for the block cache
+  }
+  // chunks are either below 1 MiB or in the HMA, which is the first 64 KiB
+  slo = slo >= MEM_SIZE ? slo - MEM_SIZE : slo;
+  dlo = dlo >= MEM_SIZE ? dlo - MEM_SIZE : dlo;
+  sp = x->mem + slo;
+  dp = x->mem + dlo;
+  if (TRACE(x, LIBXTEM_TRACE_MEM)) {
+    trace_mem(x,
+              kind == STR_MOVS || kind == STR_STOS ? TR_MEMW : TR_MEMR,
+              kind == STR_LODS ? slo : dlo,
+              w,
+              kind == STR_LODS ? sp : dp);
+  }
+  switch (kind) {
+    case STR_STOS:
+      if (!w || x->r[0].b.l == x->r[0].b.h) {
+        memset(dp, x->r[0].b.l, len);
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          memcpy(dp + 2 * i, &AX, 2);
         }
-        break;
-      case 0x40: //	INC		eAX
-        IP++;
-        printf("INC		AX\n");
-        if (AX == 0xff) {
-          FL |= AF;
-        } else {
-          FL &= (uint16_t)~AF;
+      }
+      done = n;
+      break;
+    case STR_MOVS:
+      if (!(FL & DF) ? dlo > slo && dlo < slo + len
+                     : dlo < slo && dlo + len > slo) {
+        // overlapping ahead of the copy : elements repeat, as on the CPU
+        for (size_t i = 0; i < n; i++) {
+          size_t e = (FL & DF ? n - 1 - i : i) * d;
+          memmove(dp + e, sp + e, d);
         }
-        if (parity_odd16(AX)) {
-          FL |= PF;
-        } else {
-          FL &= (uint16_t)~PF;
+      } else {
+        memmove(dp, sp, len);
+      }
+      done = n;
+      break;
+    case STR_LODS:
+      wr(&AX, w, str_at(x, sp, n - 1, n, w));
+      done = n;
+      break;
+    default: // CMPS, SCAS : up to the first element ending the REP
+      if (kind == STR_SCAS && !w && !(FL & DF) && x->def_rep == REP_REPNZ) {
+        const uint8_t* hit = memchr(dp, x->r[0].b.l, n);
+        done = hit ? (size_t)(hit - dp) + 1 : n;
+        *stop = !!hit;
+      } else {
+        uint16_t a = AX & (w ? 0xffff : 0xff);
+        for (done = 0; done < n && !*stop; done++) {
+          if (kind == STR_CMPS) {
+            a = str_at(x, sp, done, n, w);
+          }
+          *stop = (a == str_at(x, dp, done, n, w)) != (x->def_rep == REP_REPZ);
         }
-        AX++;
-        break;
-#if 0
-		case 0x4e://	DEC		eSI
-			IP++;
-			printf("DEC		eSI\n");
-			SI--;
-			break;
+      }
+      alu(x,
+          0x7,
+          w,
+          kind == STR_SCAS ? AX & (w ? 0xffff : 0xff)
+                           : str_at(x, sp, done - 1, n, w),
+          str_at(x, dp, done - 1, n, w));
+      break;
+  }
+  return done;
+}
+
+// one element, return : 1 when a CMPS/SCAS condition ends the REP
+static int
+str_elem(xtem_t* x, int kind, int w, uint16_t seg)
+{
+  uint16_t d = w ? 2 : 1;
+  uint16_t v;
+  switch (kind) {
+    case STR_MOVS:
+      str_wr(x, ES, DI, w, str_rd(x, seg, SI, w));
+      break;
+    case STR_CMPS:
+      alu(x, 0x7, w, str_rd(x, seg, SI, w), str_rd(x, ES, DI, w));
+      break;
+    case STR_STOS:
+      str_wr(x, ES, DI, w, AX);
+      break;
+    case STR_LODS:
+      wr(&AX, w, str_rd(x, seg, SI, w));
+      break;
+    default: // SCAS
+      alu(x, 0x7, w, AX & (w ? 0xffff : 0xff), str_rd(x, ES, DI, w));
+      break;
+  }
+  if (FL & DF) {
+    d = (uint16_t)-d;
+  }
+  if (kind != STR_STOS && kind != STR_SCAS) {
+    SI = (uint16_t)(SI + d);
+  }
+  if (kind != STR_LODS) {
+    DI = (uint16_t)(DI + d);
+  }
+  if (kind != STR_CMPS && kind != STR_SCAS) {
+    return 0;
+  }
+  v = flags_get(x);
+  return !!(v & ZF) != (x->def_rep == REP_REPZ);
+}
+
+#define STR_YIELD 256 // REP elements between deadline checks, at most
+
+static int
+op_string(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  int w = op->flags & OPF_W;
+  int kind = (opc[0] >> 1) & 7;
+  uint16_t seg = x->def_seg ? *sreg(x, (int)x->def_seg - SEG_ES) : DS;
+  int stop = 0;
+  uint16_t cx = CX;
+  IP++;
+  if (x->def_rep == REP_NOT) {
+    str_elem(x, kind, w, seg);
+    return 0;
+  }
+  while (CX && !stop) {
+    size_t n =
+      str_bulk(x, kind, w, seg, CX < STR_YIELD ? CX : STR_YIELD, &stop);
+    if (n) {
+      uint16_t d = (uint16_t)(n * (w ? 2 : 1));
+      if (FL & DF) {
+        d = (uint16_t)-d;
+      }
+      if (kind != STR_STOS && kind != STR_SCAS) {
+        SI = (uint16_t)(SI + d);
+      }
+      if (kind != STR_LODS) {
+        DI = (uint16_t)(DI + d);
+      }
+      CX = (uint16_t)(CX - n);
+    } else {
+      stop = str_elem(x, kind, w, seg);
+      CX--;
+    }
+    if (CX && !stop &&
+        x->cycles + (uint64_t)(cx - CX) * str_rep_cycles[kind][!!w] >=
+          x->deadline) {
+      // IRQ, event or budget : restart from the prefixes, as an interrupted
+      // 8086 does, with CX SI DI as they are now
+      IP = x->pfx_ip;
+      break;
+    }
+  }
+  x->cycles += (uint64_t)(cx - CX) * str_rep_cycles[kind][!!w];
+  return 0;
+}
+
+/* IN and OUT, with the port in an Ib or DX
+   accesses to unclaimed ports exit with RET_IO when x->io_exit, after an
+   IN got all ones */
+static int
+op_io(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  int out = opc[0] & 2;
+  int size = op->flags & OPF_W ? 2 : 1;
+  uint16_t port;
+  uint16_t v;
+  if (op->a[!out] == A_Ib) {
+    IP += 2;
+    port = opc[1];
+  } else {
+    IP++;
+    port = DX;
+  }
+  if (out) {
+    v = size == 2 ? AX : AX & 0xff;
+    io_out(x, port, v, size);
+  } else {
+    v = io_in(x, port, size);
+    wr(&AX, size == 2, v);
+  }
+  if (TRACE(x, LIBXTEM_TRACE_INSN)) {
+    trace_io(x, out ? TR_OUT : TR_IN, port, v, size);
+  }
+  if (x->io_exit && !x->io_map[port]) {
+    x->io.port = port;
+    x->io.value = v;
+    x->io.size = (uint8_t)size;
+    x->io.out = !!out;
+    return RET_IO;
+  }
+  return 0;
+}
+
+static int
+op_hlt(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  x->halted = 1; // see xtem_poll()
+  ev_deadline(x);
+  return 0;
+}
+
+static void
+push16(xtem_t* x, uint16_t v)
+{
+  SP = (uint16_t)(SP - 2);
+  str_wr(x, SS, SP, 1, v);
+}
+
+static uint16_t
+pop16(xtem_t* x)
+{
+  uint16_t v = str_rd(x, SS, SP, 1);
+  SP = (uint16_t)(SP + 2);
+  return v;
+}
+
+// 8086 FLAGS, as pushed : bits 12 to 15 and 1 set, 3 and 5 clear
+static void
+flags_pop(xtem_t* x, uint16_t fl)
+{
+  flags_set(x, (uint16_t)((fl & 0x0fd5) | 0xf002));
+  ev_deadline(x); // IF may have enabled a pending IRQ
+}
+
+static void
+int_enter(xtem_t* x, uint8_t n)
+{
+  push16(x, flags_get(x));
+  FL &= (uint16_t)~(IF | TF);
+  push16(x, CS);
+  push16(x, IP);
+  IP = str_rd(x, 0, (uint16_t)(n * 4), 1);
+  CS = str_rd(x, 0, (uint16_t)(n * 4 + 2), 1);
+}
+
+/* nothing changes until the next event : skip to it */
+static void
+xtem_skip(xtem_t* x)
+{
+  uint64_t next = ev_next(x);
+  if (next != UINT64_MAX && next > x->cycles) {
+    x->idle += next - x->cycles;
+    x->cycles = next;
+  }
+}
+
+/* run the events due, and take the hardware interrupt requested, if any,
+   but not between a prefix and its instruction; a halted CPU skips to the
+   events until one raises an interrupt
+   return : 1 if still halted, RET_HLT if nothing can end that */
+static int
+xtem_poll(xtem_t* x)
+{
+  if (x->watch_hit.type) {
+    return RET_WATCH;
+  }
+  if (x->halted) {
+    if (!(FL & IF) || (!x->evs && !x->irq)) {
+      return RET_HLT;
+    }
+    xtem_skip(x);
+  }
+  ev_run(x);
+  if (x->irq && (FL & IF) && x->def_seg == SEG_NONE && x->def_rep == REP_NOT) {
+    x->halted = 0;
+    int_enter(x, pic_ack(x));
+    if (PROF(x)) {
+      prof_call(x);
+    }
+    ev_deadline(x);
+  }
+  return x->halted;
+}
+
+static int
+op_int(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  if (op->a[0] == A_3) {
+    size_t pc = (size_t)CS * 16 + IP;
+    // IP stays on the INT 3 : resuming right there dispatches it, as bp_stop()
+    if (pc != x->bp_hit || x->bc->insns != x->bp_insns) {
+      x->bp_hit = pc;
+      x->bp_insns = x->bc->insns + 1; // counted once this returns
+      return RET_BREAK;
+    }
+    IP++;
+    int_enter(x, 3);
+    return 0;
+  }
+  IP += 2;
+  int_enter(x, opc[1]);
+  return 0;
+}
+
+static int
+op_iret(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP = pop16(x);
+  CS = pop16(x);
+  flags_pop(x, pop16(x));
+  return 0;
+}
+
+static int
+op_pushf(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  push16(x, (uint16_t)(flags_get(x) | 0xf002));
+  return 0;
+}
+
+static int
+op_popf(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  flags_pop(x, pop16(x));
+  return 0;
+}
+
+static int
+op_sti(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  FL |= IF;
+  ev_deadline(x);
+  return 0;
+}
+
+static int
+op_jmp(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  switch (op->a[0]) {
+    case A_Ap:
+      IP = *(uint16_t*)(opc + 1);
+      CS = *(uint16_t*)(opc + 3);
+      break;
+    case A_Jv:
+      IP = (uint16_t)(IP + 3 + *(uint16_t*)(opc + 1));
+      break;
+    case A_Jb:
+      IP = (uint16_t)(IP + 2 + (int8_t)opc[1]);
+      break;
+    default:
+      return op_notimp(x, op, opc);
+  }
+  return 0;
+}
+
+static int
+op_cli(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  FL &= (uint16_t)~IF;
+  return 0;
+}
+
+static int
+op_cld(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  FL &= (uint16_t)~DF;
+  return 0;
+}
+
+static int
+op_sahf(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  // SF ZF AF PF CF from AH, bit 1 set, 3 and 5 clear as for POPF
+  flags_set(x,
+            (uint16_t)((flags_get(x) & 0xff00) | (x->r[0].b.h & 0xd5) | 0x02));
+  return 0;
+}
+
+static int
+op_lahf(xtem_t* x, const op_t* op, uint8_t* opc)
+{
+  op = op;
+  opc = opc;
+  IP++;
+  x->r[0].b.h = (uint8_t)flags_get(x);
+  return 0;
+}
+
+#define H_SAHF op_sahf
+#define H_LAHF op_lahf
+#define H_ES_ op_segpfx
+#define H_CS_ op_segpfx
+#define H_SS_ op_segpfx
+#define H_DS_ op_segpfx
+#define H_REPNZ op_rep
+#define H_REPZ op_rep
+#define H_ADD op_alu
+#define H_OR op_alu
+#define H_ADC op_alu
+#define H_SBB op_alu
+#define H_AND op_alu
+#define H_SUB op_alu
+#define H_XOR op_alu
+#define H_CMP op_alu
+#define H_INC op_incdec
+#define H_DEC op_incdec
+#define H_LEA op_lea
+#define H_JO op_jcc
+#define H_JNO op_jcc
+#define H_JB op_jcc
+#define H_JNB op_jcc
+#define H_JZ op_jcc
+#define H_JNZ op_jcc
+#define H_JBE op_jcc
+#define H_JA op_jcc
+#define H_JS op_jcc
+#define H_JNS op_jcc
+#define H_JPE op_jcc
+#define H_JPO op_jcc
+#define H_JL op_jcc
+#define H_JGE op_jcc
+#define H_JLE op_jcc
+#define H_JG op_jcc
+#define H_MOV op_mov
+#define H_NOP op_nop
+#define H_MOVSB op_string
+#define H_MOVSW op_string
+#define H_CMPSB op_string
+#define H_CMPSW op_string
+#define H_STOSB op_string
+#define H_STOSW op_string
+#define H_LODSB op_string
+#define H_LODSW op_string
+#define H_SCASB op_string
+#define H_SCASW op_string
+#define H_IN op_io
+#define H_OUT op_io
+#define H_JMP op_jmp
+#define H_HLT op_hlt
+#define H_INT op_int
+#define H_IRET op_iret
+#define H_PUSHF op_pushf
+#define H_POPF op_popf
+#define H_STI op_sti
+#define H_CLI op_cli
+#define H_CLD op_cld
+#define H_GRP1 op_grp
+#define H_GRP2 op_grp
+#define H_GRP3a op_grp
+#define H_GRP3b op_grp
+#define H_GRP4 op_grp
+#define H_GRP5 op_grp
+#include "8086_table.h"
+
+/* fetch and decode the instruction at linear address addr
+   return : its (GRPn sub-table) op_t, for the decoder flags */
+static const op_t*
+insn_decode(xtem_t* x, insn_t* in, size_t addr)
+{
+  const op_t* op;
+  mem_fetch(x, in->b, sizeof(in->b), addr);
+  in->op = op = &op_table[in->b[0]];
+  if (op->grp) {
+    op = &op->grp[(in->b[1] & 0x38) >> 3];
+  }
+  in->len = (uint8_t)(1 + op->imm);
+  in->cycles = op->cycles[0];
+  if (op->flags & OPF_MODRM) {
+    const modrm_t* m = &modrm_table[in->b[1]];
+    in->len = (uint8_t)(in->len + 1 + m->disp);
+    if (m->mod != 3) {
+      in->cycles = (uint8_t)(op->cycles[1] + m->ea);
+    }
+  }
+#ifdef XTEM_THREADED
+  in->lbl = 0;
 #endif
-      case 0x75: //	JNZ		Ib
-        IP++;
-        Ib = *(uint8_t*)(opc + 1);
-        IP++;
-        printf("JNZ		Ib\n");
-        if (!(FL & ZF)) {
-          IP += Ib;
-        }
+  return op;
+}
+
+#ifdef XTEM_THREADED
+/* direct threaded core (GCC/Clang labels as values)
+   each insn_t carries the label of its handler, resolved on the first run of
+   the sequence, and every handler body ends with its own copy of the
+   dispatch, jumping straight to the next instruction's handler; the op=0
+   terminator dispatches to the exit.
+   b is the block the sequence belongs to, if any, to notice invalidation.
+   return : same as step(), for the last executed instruction */
+#define THREADED_HANDLERS(H)                                                   \
+  H(op_alu)                                                                    \
+  H(op_mov)                                                                    \
+  H(op_jcc)                                                                    \
+  H(op_incdec)                                                                 \
+  H(op_lea)                                                                    \
+  H(op_grp)                                                                    \
+  H(op_segpfx)                                                                 \
+  H(op_rep)                                                                    \
+  H(op_string)                                                                 \
+  H(op_jmp)                                                                    \
+  H(op_io)                                                                     \
+  H(op_nop)
+static int
+threaded_run(xtem_t* x, const block_t* b, insn_t* in, size_t pc)
+{
+  int ret = 0;
+  if (!in->lbl) {
+    for (insn_t* i = in;; i++) {
+      if (!i->op) {
+        i->lbl = &&l_end;
         break;
-#if 1
-      // PC=fe0ca OPC=89 15
-      // 100010 0 1 00 010 101
-      // mod=0 reg=2 rm=5
-      // 000FE0CA  8915              mov    WORD PTR [di],dx
-      case 0x89: //	MOV		REG16/MEM16,REG16
-        mod = (opc[1] & 0xc0) >> 6;
-        reg = (opc[1] & 0x38) >> 3;
-        rm = opc[1] & 0x07;
-        mem = 0;
-        len = 2;
-        printf("MOV		REG16/MEM16,REG16\n");
-        switch (mod) {
-          case 0x0: // memory mode, no displacement follows except rm==6
-            switch (rm) {
-              case 0x5: //(di)
-                printf("USING SEG %s\n", x->def_seg == SEG_ES ? "ES" : "DS");
-                addr = (size_t)(x->def_seg == SEG_ES ? ES : DS) * 16 + DI;
-                memw(x, (void**)&mem, &len, addr);
-                if (!mem) {
-                  NOTIMP("Failed to acquire mem\n");
-                  return -1;
-                }
-                break;
-              default:
-                ret = -5;
-                NOTIMP("???? mod=%01" PRIx8 " reg=%01" PRIx8 " rm=%01" PRIx8
-                       "\n",
-                       mod,
-                       reg,
-                       rm);
-                break;
-            }
-            break;
-#if 0
-				case 0x1://memory mode, disp8 follows
-					break;
-				case 0x2://memory mode, disp16 follows
-					break;
-				case 0x3://register mode, no displacement follows
-					break;
+      }
+#define RESOLVE(h) i->op->fn == h ? &&l_##h:
+      i->lbl = THREADED_HANDLERS(RESOLVE) &&l_call;
+#undef RESOLVE
+    }
+  }
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (TRACE(x, LIBXTEM_TRACE_REGS)) {                                        \
+      trace_regs(x);                                                           \
+    }                                                                          \
+    if (PROF(x)) {                                                             \
+      prof_insn(x, pc, in->b, ret);                                            \
+    }                                                                          \
+    x->bc->insns++;                                                            \
+    x->cycles += in->cycles;                                                   \
+    if (ret != 1) {                                                            \
+      x->def_seg = SEG_NONE;                                                   \
+      x->def_rep = REP_NOT;                                                    \
+    }                                                                          \
+    pc += in->len;                                                             \
+    if (ret < 0 || (b && b->pc == BC_NONE) || (size_t)CS * 16 + IP != pc ||   \
+        x->cycles >= x->deadline) {                                            \
+      return ret;                                                              \
+    }                                                                          \
+    in++;                                                                      \
+    if (in->op && TRACE(x, LIBXTEM_TRACE_INSN)) {                              \
+      trace_insn(x, pc, in->b);                                                \
+    }                                                                          \
+    goto* in->lbl;                                                             \
+  } while (0)
+  if (TRACE(x, LIBXTEM_TRACE_INSN)) {
+    trace_insn(x, pc, in->b);
+  }
+  goto* in->lbl;
+#define HANDLER(h)                                                             \
+  l_##h : ret = h(x, in->op, in->b);                                           \
+  DISPATCH();
+  THREADED_HANDLERS(HANDLER)
+#undef HANDLER
+l_call:
+  ret = in->op->fn(x, in->op, in->b);
+  DISPATCH();
+#undef DISPATCH
+l_end:
+  return ret;
+}
+#else
+static int
+insn_exec(xtem_t* x, insn_t* in, size_t pc)
+{
+  int ret;
+  if (TRACE(x, LIBXTEM_TRACE_INSN)) {
+    trace_insn(x, pc, in->b);
+  }
+  ret = in->op->fn(x, in->op, in->b);
+  if (TRACE(x, LIBXTEM_TRACE_REGS)) {
+    trace_regs(x);
+  }
+  if (PROF(x)) {
+    prof_insn(x, pc, in->b, ret);
+  }
+  x->bc->insns++;
+  x->cycles += in->cycles;
+  if (ret != 1) {
+    // prefixes only apply to the next instruction
+    x->def_seg = SEG_NONE;
+    x->def_rep = REP_NOT;
+  }
+  return ret;
+}
 #endif
-          default:
-            ret = -5;
-            NOTIMP("mod=%02" PRIx8 "\n", mod);
-            break;
-        }
-        if (mem) {
-          uint16_t regv;
-          switch (reg) {
-            case 0x2:
-              regv = DX;
-              break;
-            default:
-              ret = -5;
-              NOTIMP("???? mod=%01" PRIx8 " reg=%01" PRIx8 " rm=%01" PRIx8 "\n",
-                     mod,
-                     reg,
-                     rm);
-              break;
-          }
-          if (!ret) {
-            IP += 2;
-            *((uint16_t*)mem) = regv;
-          }
-        } else {
-          ret = -1;
-          NOTIMP("!mem\n");
-          break;
-        }
-        break;
+
+// return : 0 => executed 1 insn succesfully
+// return : 1 => executed 1 prefix succesfully (eg: not atomic for IRQ handling)
+// return : <0 => error or stop, RET_*
+static int
+step(xtem_t* x)
+{
+  size_t pc;
+  insn_t in[2] = { { 0 } };
+  int ret;
+  if (x->cycles >= x->deadline && (ret = xtem_poll(x))) {
+    return ret < 0 ? ret : 0;
+  }
+  pc = (size_t)CS * 16 + IP;
+  if (bp_page(x, pc) && bp_stop(x, pc)) {
+    return RET_BREAK;
+  }
+  insn_decode(x, &in[0], pc);
+#ifdef XTEM_THREADED
+  return threaded_run(x, 0, in, pc);
+#else
+  return insn_exec(x, &in[0], pc);
 #endif
-#if 1
-      //               d w mod reg r/m
-      // 8B36 : 100010 1 1  00 110 110
-      // 8BE8 : 100010 1 1  11 011 000
-      // 8B367200          mov si,[0x72]
-      // 8BE8              mov bp,ax
-      case 0x8B: //	MOV		REG16,REG16
-        mod = (opc[1] & 0xc0) >> 6;
-        reg = (opc[1] & 0x38) >> 3;
-        rm = opc[1] & 0x07;
-        printf("MOV		REG16/MEM16,REG16\n");
-        if (mod == 0x00) {
-          Ev = *(uint8_t*)(opc + 1);
-          Gv = *(uint16_t*)(opc + 2);
-          mem = 0;
-          len = 2;
-          printf("USING SEG %s\n", x->def_seg == SEG_ES ? "ES" : "DS");
-          addr = (size_t)(x->def_seg == SEG_ES ? ES : DS) * 16 + Gv;
-          memr(x, (void**)&mem, &len, addr);
-          if (!mem) {
-            NOTIMP("Failed to acquire mem\n");
-            return -1;
-          }
-          switch (reg) {
-            case 0x06:
-              SI = *mem;
-              break;
-            default:
-              ret = -5;
-              NOTIMP("reg=%02" PRIx8 "\n", reg);
-              break;
-          }
-          if (!ret) {
-            IP += 4;
-          }
-        } else if (mod == 0x03) {
-          switch (rm) {
-            case 0x00:
-              Iw = AX;
-              break;
-            default:
-              ret = -5;
-              NOTIMP("rm=%02" PRIx8 "\n", rm);
-              break;
-          }
-          switch (reg) {
-            case 0x00:
-              AX = Iw;
-              break;
-            case 0x01:
-              CX = Iw;
-              break;
-            case 0x02:
-              DX = Iw;
-              break;
-            case 0x03:
-              BX = Iw;
-              break;
-            case 0x04:
-              SP = Iw;
-              break;
-            case 0x05:
-              BP = Iw;
-              break;
-            case 0x06:
-              SI = Iw;
-              break;
-            case 0x07:
-              DI = Iw;
-              break;
-            default:
-              ret = -5;
-              NOTIMP("reg=%02" PRIx8 "\n", reg);
-              break;
-          }
-          if (!ret) {
-            IP += 2;
-          }
-        } else {
-          ret = -5;
-          NOTIMP("mod=%02" PRIx8 "\n", mod);
-        }
-        break;
+}
+
+/* whether running op only changes registers, including by reading ports
+   and memory : a block of those ending where it started, with the
+   registers as they were, is waiting for a device */
+static int
+insn_pure(const insn_t* in, const op_t* op)
+{
+  int mem = (op->flags & OPF_MODRM) && modrm_table[in->b[1]].mod != 3;
+  int wr_mem = op->a[0] == A_Ob || op->a[0] == A_Ov ||
+               (mem && (op->a[0] == A_Eb || op->a[0] == A_Ev ||
+                        op->a[0] == A_Ew) && strcmp(op->name, "CMP"));
+  if (op->fn == op_io) {
+    return !(in->b[0] & 2); // IN
+  }
+  return (op->fn == op_alu || op->fn == op_mov || op->fn == op_jcc ||
+          op->fn == op_jmp || op->fn == op_nop || op->fn == op_lea) &&
+         !wr_mem;
+}
+
+static void
+bc_fill(xtem_t* x, block_t* b, size_t pc)
+{
+  size_t addr = pc;
+  b->n = 0;
+  b->poll = 1;
+  b->bp = bp_page(x, pc);
+  while (b->n < BC_INSNS) {
+    insn_t* in;
+    if (b->n && bp_page(x, addr) && bp_at(x, addr)) {
+      break; // the breakpoint starts a block of its own
+    }
+    in = &b->insn[b->n++];
+    const op_t* op = insn_decode(x, in, addr);
+    addr += in->len;
+    b->poll = b->poll && insn_pure(in, op);
+    if (op->flags & OPF_JUMP) {
+      break;
+    }
+  }
+  b->insn[b->n].op = 0;
+#ifdef XTEM_THREADED
+  b->insn[b->n].lbl = 0;
 #endif
-#if 1
-      case 0x8E: //	MOV		Sw	Ew
-        IP++;
-        uint16_t Sw = (*(uint16_t*)(opc + 1) & 0xF0) >> 4;
-        uint16_t Ew = *(uint16_t*)(opc + 1) & 0x0F;
-        IP++;
-        printf("MOV		Sw	Ew\n");
-        uint16_t regv;
-        switch (Ew) {
-          case 0x3: // bx
-            regv = BX;
-            break;
-          case 0x8: // ax
-            regv = AX;
-            break;
-          default:
-            ret = -5;
-            NOTIMP("Ew=%01" PRIx8 "\n", Ew);
-            break;
-        }
-        switch (Sw) {
-          case 0xC: // es
-            printf("SETTING ES=%04" PRIx16 "\n", regv);
-            ES = regv;
-            break;
-          case 0xD: // ds
-            printf("SETTING DS=%04" PRIx16 "\n", regv);
-            DS = regv;
-            break;
-          default:
-            ret = -4;
-            NOTIMP("Sw=%01" PRIx8 "\n", Sw);
-            break;
-        }
-        break;
+  b->pc = pc;
+  b->end = addr;
+#ifdef XTEM_JIT
+  b->count = 0;
+  b->jit = 0;
 #endif
-      case 0x90: //	NOP
-        IP++;
-        printf("NOP\n");
-        break;
-      case 0xAB: //	STOSW
-        IP++;
-        printf("STOSW\n");
-        printf("USING REP %s\n",
-               x->def_rep == REP_REPNZ  ? "REPNZ"
-               : x->def_rep == REP_REPZ ? "REPZ"
-                                        : "REP");
-        mem = 0;
-        len = 2;
-        addr = (size_t)ES * 16 + DI;
-        memw(x, (void**)&mem, &len, addr);
-        if (!mem) {
-          NOTIMP("Failed to acquire mem\n");
-          return -1;
-        }
-        while (1) {
-          *((uint16_t*)mem) = AX;
-          DI += 2;
-          if (x->def_rep == REP_NOT) {
-            break;
-          }
-          CX--;
-          if (((x->def_rep == REP_REPNZ) && (!CX)) ||
-              ((x->def_rep == REP_REPZ) && (!CX))) {
-            break;
-          }
-        }
-        //			ret = -1;
-        break;
-      case 0xB0 ... 0xB7: //	MOV		Reg8	Ib
-        IP++;
-        reg = *(uint8_t*)(opc + 0) & 0x7;
-        Ib = *(uint8_t*)(opc + 1);
-        IP++;
-        printf(
-          "MOV		Reg8=%01" PRIx8 "	Ib=%02" PRIx8 "\n", reg, Ib);
-        switch (reg) {
-          case 0x0:
-            AX &= 0xff00;
-            AX |= Ib;
-            break;
-          case 0x1:
-            CX &= 0xff00;
-            CX |= Ib;
-            break;
-          case 0x2:
-            DX &= 0xff00;
-            DX |= Ib;
-            break;
-          case 0x3:
-            BX &= 0xff00;
-            BX |= Ib;
-            break;
-          case 0x4:
-            AX &= 0xff;
-            AX |= Ib << 8;
-            break;
-          case 0x5:
-            CX &= 0xff;
-            CX |= Ib << 8;
-            break;
-          case 0x6:
-            DX &= 0xff;
-            DX |= Ib << 8;
-            break;
-          case 0x7:
-            BX &= 0xff;
-            BX |= Ib << 8;
-            break;
-        }
-        break;
-      case 0xB8 ... 0xBF: //	MOV		Reg16	Iw
-        IP++;
-        reg = *(uint8_t*)(opc + 0) & 0x7;
-        Iw = *(uint16_t*)(opc + 1);
-        IP += 2;
-        printf(
-          "MOV		Reg16=%01" PRIx8 "	Ib=%04" PRIx16 "\n", reg, Iw);
-        switch (reg) {
-          case 0x0:
-            AX = Iw;
-            break;
-          case 0x1:
-            CX = Iw;
-            break;
-          case 0x2:
-            DX = Iw;
-            break;
-          case 0x3:
-            BX = Iw;
-            break;
-          case 0x4:
-            SP = Iw;
-            break;
-          case 0x5:
-            BP = Iw;
-            break;
-          case 0x6:
-            SI = Iw;
-            break;
-          case 0x7:
-            DI = Iw;
-            break;
-        }
-        break;
-      case 0xE6: //	OUT		Ib	AL
-        IP++;
-        Ib = *(uint8_t*)(opc + 1);
-        IP++;
-        printf("OUT Ib=%02" PRIx8 " AL=%02" PRIx8 "\t\t[%s]\n",
-               Ib,
-               AX & 0xff,
-               hint_out(Ib, AX & 0xff));
-        break;
-      case 0xea: //	JMP		Ap
-        IP++;
-        uint16_t ofs = *(uint16_t*)(opc + 1);
-        seg = *(uint16_t*)(opc + 3);
-        printf("JMP		Ap=%04" PRIx16 ":%04" PRIx16 "\n", seg, ofs);
-        CS = seg;
-        IP = ofs;
-        break;
-      case 0xEE: //	OUT		DX	AL
-        IP++;
-        printf("OUT DX=%04" PRIx16 " AL=%02" PRIx8 "\t[%s]\n",
-               DX,
-               AX & 0xff,
-               hint_out(DX, AX & 0xff));
-        break;
-      case 0xfa: //	CLI
-        IP++;
-        printf("CLI\n");
-        FL &= (uint16_t)~(1 << 9);
-        break;
-      case 0xfc: //	CLD
-        IP++;
-        printf("CLD\n");
-        FL &= (uint16_t)~(1 << 10);
-        break;
-      case 0xFE: //	GRP4	Eb
-        IP++;
-        Eb = *(uint8_t*)(opc + 1);
-        IP++;
-        printf("GRP4	Eb=%02" PRIx8 " : ", Eb);
-        switch (Eb) {
-          case 0xC0: // GRP4/0	INC
-            printf("INC		Al\n");
-            AX = (AX & 0xff00) | (((AX & 0xff) + 1));
-            break;
-          default:
-            ret = -3;
-            NOTIMP("GRP4/%01" PRIx8 "\n", Eb & 0xf);
-            break;
-        }
-        break;
-      default:
-        ret = -2;
-        NOTIMP("PC=%05" PRIx32 " OPC=%02" PRIx8 " %02" PRIx8 " %02" PRIx8
-               " %02" PRIx8 "\n",
-               (uint32_t)pc,
-               opc[0],
-               opc[1],
-               opc[2],
-               opc[3]);
+  for (size_t p = pc >> PAGE_SHIFT; p <= (addr - 1) >> PAGE_SHIFT; p++) {
+    x->bc->code[p]++;
+  }
+}
+
+#ifdef XTEM_JIT
+/* x86-64 code emitter
+   inside translations, rbx holds x and r12 &x->bc->insns */
+static void
+e8(uint8_t** p, unsigned v)
+{
+  *(*p)++ = (uint8_t)v;
+}
+
+static void
+e16(uint8_t** p, unsigned v)
+{
+  uint16_t w = (uint16_t)v;
+  memcpy(*p, &w, sizeof(w));
+  *p += sizeof(w);
+}
+
+static void
+e32(uint8_t** p, uint32_t v)
+{
+  memcpy(*p, &v, sizeof(v));
+  *p += sizeof(v);
+}
+
+static void
+e64(uint8_t** p, uint64_t v)
+{
+  memcpy(*p, &v, sizeof(v));
+  *p += sizeof(v);
+}
+
+// opcode, ModR/M [rbx+disp32] with reg field r
+static void
+e_rbx(uint8_t** p, unsigned opc, unsigned r, size_t ofs)
+{
+  e8(p, opc);
+  e8(p, 0x83 | r << 3);
+  e32(p, (uint32_t)ofs);
+}
+
+// jcc rel32 (cc = 0x84 je, 0x85 jne) to target
+static void
+e_jcc(uint8_t** p, unsigned cc, const uint8_t* target)
+{
+  e8(p, 0x0f);
+  e8(p, cc);
+  e32(p, (uint32_t)(target - (*p + 4)));
+}
+
+// mov rax, imm64
+static void
+e_movrax(uint8_t** p, const void* v)
+{
+  e8(p, 0x48);
+  e8(p, 0xb8);
+  e64(p, (uint64_t)(uintptr_t)v);
+}
+
+// write back the IP advance of natively translated instructions
+static void
+e_ip(uint8_t** p, uint16_t* dip)
+{
+  if (*dip) {
+    e8(p, 0x66);
+    e_rbx(p, 0x81, 0, offsetof(xtem_t, ip)); // add word [ip], imm16
+    e16(p, *dip);
+    *dip = 0;
+  }
+}
+
+static void
+jit_flush(xtem_t* x)
+{
+  for (int i = 0; i < BC_BLOCKS; i++) {
+    x->bc->block[i].jit = 0;
+  }
+  x->jit->used = 0;
+  x->jit->flushes++;
+}
+
+/* next translated block to run, called from the end of translations
+   return : its body, 0 => back to block_run(), eg: for events due */
+static uint8_t*
+jit_chain(xtem_t* x)
+{
+  size_t pc = (size_t)CS * 16 + IP;
+  block_t* b = &x->bc->block[BC_HASH(pc)];
+  if (b->pc != pc || !b->jit || x->jit->chain-- <= 0 ||
+      x->cycles >= x->deadline) {
+    return 0;
+  }
+  x->bc->hits++;
+  return b->body;
+}
+
+/* translate a decoded block to x86-64, as an int (*)(xtem_t*) with the
+   same return values as step()
+   guest state stays in xtem_t, since the handlers work on it : MOV
+   reg/imm, NOP, CLI, CLD and direct JMPs are done inline, IP advances are
+   batched until something reads IP, and all other instructions call their
+   handler, as the interpreter does. Each call is followed by the error and
+   invalidation checks of block_run(), and the end of the block chains to
+   the next translated one through jit_chain(). */
+static void
+jit_translate(xtem_t* x, block_t* b)
+{
+  jit_t* j = x->jit;
+  uint8_t* p;
+  uint8_t* exit_ret;
+  uint8_t* exit_0;
+  uint16_t dip = 0; // IP advance not written back yet
+  int prefix = 0;   // previous instruction was a prefix
+  size_t pc = b->pc;
+  _Static_assert(sizeof(x->def_seg) == 4 && sizeof(x->def_rep) == 4,
+                 "prefix state is reset with 32 bit stores");
+  if (j->used + JIT_BLOCK_MAX > JIT_CODE_SIZE) {
+    jit_flush(x);
+  }
+  p = j->code + j->used;
+  exit_ret = p;
+  e8(&p, 0x41); // pop r13
+  e8(&p, 0x5d);
+  e8(&p, 0x41); // pop r12
+  e8(&p, 0x5c);
+  e8(&p, 0x5b); // pop rbx
+  e8(&p, 0xc3); // ret
+  exit_0 = p;
+  e8(&p, 0x31); // xor eax, eax
+  e8(&p, 0xc0);
+  e8(&p, 0xeb); // jmp exit_ret
+  e8(&p, (unsigned)(exit_ret - (p + 1)));
+  b->jit = p;
+  e8(&p, 0x53); // push rbx
+  e8(&p, 0x41); // push r12
+  e8(&p, 0x54);
+  e8(&p, 0x41); // push r13, keeps the stack aligned for calls
+  e8(&p, 0x55);
+  e8(&p, 0x48); // mov rbx, rdi
+  e8(&p, 0x89);
+  e8(&p, 0xfb);
+  e8(&p, 0x4c); // mov r12, [rdi+bc]
+  e8(&p, 0x8b);
+  e8(&p, 0xa7);
+  e32(&p, offsetof(xtem_t, bc));
+  e8(&p, 0x49); // add r12, insns
+  e8(&p, 0x81);
+  e8(&p, 0xc4);
+  e32(&p, offsetof(bc_t, insns));
+  b->body = p;
+  for (int i = 0; i < b->n; i++) {
+    insn_t* in = &b->insn[i];
+    uint8_t* opc = in->b;
+    int is_prefix = in->op->fn == op_segpfx || in->op->fn == op_rep;
+    e8(&p, 0x49); // inc qword [r12]
+    e8(&p, 0xff);
+    e8(&p, 0x04);
+    e8(&p, 0x24);
+    e8(&p, 0x48);
+    e_rbx(&p, 0x81, 0, offsetof(xtem_t, cycles)); // add qword [cycles], imm32
+    e32(&p, in->cycles);
+    pc += in->len;
+    if (opc[0] >= 0xb0 && opc[0] <= 0xb7) {
+      int n = opc[0] & 7;
+      e_rbx(&p,
+            0xc6,
+            0,
+            offsetof(xtem_t, r) + (size_t)(n & 3) * sizeof(reg_t) +
+              (n < 4 ? 0 : 1));
+      e8(&p, opc[1]);
+      dip = (uint16_t)(dip + 2);
+    } else if (opc[0] >= 0xb8 && opc[0] <= 0xbf) {
+      e8(&p, 0x66);
+      e_rbx(&p, 0xc7, 0, offsetof(xtem_t, r) + (opc[0] & 7u) * sizeof(reg_t));
+      e16(&p, *(uint16_t*)(opc + 1));
+      dip = (uint16_t)(dip + 3);
+    } else if (opc[0] == 0x90) {
+      dip = (uint16_t)(dip + 1);
+    } else if (opc[0] == 0xfa || opc[0] == 0xfc) {
+      e8(&p, 0x66);
+      e_rbx(&p, 0x81, 4, offsetof(xtem_t, fl)); // and word [fl], imm16
+      e16(&p, (uint16_t) ~(opc[0] == 0xfa ? IF : DF));
+      dip = (uint16_t)(dip + 1);
+    } else if (opc[0] == 0xeb) {
+      dip = (uint16_t)(dip + 2 + (int8_t)opc[1]);
+    } else if (opc[0] == 0xe9) {
+      dip = (uint16_t)(dip + 3 + *(uint16_t*)(opc + 1));
+    } else if (opc[0] == 0xea) {
+      dip = 0;
+      e8(&p, 0x66);
+      e_rbx(&p, 0xc7, 0, offsetof(xtem_t, ip));
+      e16(&p, *(uint16_t*)(opc + 1));
+      e8(&p, 0x66);
+      e_rbx(&p, 0xc7, 0, offsetof(xtem_t, s.cs));
+      e16(&p, *(uint16_t*)(opc + 3));
+    } else {
+      e_ip(&p, &dip);
+      e8(&p, 0x48); // mov rdi, rbx
+      e8(&p, 0x89);
+      e8(&p, 0xdf);
+      e8(&p, 0x48); // mov rsi, op
+      e8(&p, 0xbe);
+      e64(&p, (uint64_t)(uintptr_t)in->op);
+      e8(&p, 0x48); // mov rdx, opc
+      e8(&p, 0xba);
+      e64(&p, (uint64_t)(uintptr_t)opc);
+      e_movrax(&p, (const void*)(uintptr_t)in->op->fn);
+      e8(&p, 0xff); // call rax
+      e8(&p, 0xd0);
+      if (!is_prefix) {
+        e8(&p, 0x85); // test eax, eax
+        e8(&p, 0xc0);
+        e_jcc(&p, 0x85, exit_ret);
+      }
+      if (!is_prefix && i + 1 < b->n) {
+        // the handler may have written to this block
+        e_movrax(&p, &b->pc);
+        e8(&p, 0x48); // cmp qword [rax], BC_NONE
+        e8(&p, 0x83);
+        e8(&p, 0x38);
+        e8(&p, 0xff);
+        e_jcc(&p, 0x84, exit_0);
+      }
+      if ((opc[0] == 0x8e || in->op->fn == op_string) && i + 1 < b->n) {
+        // MOV Sw may have moved CS, a REP string op yielded to its prefix
+        e8(&p, 0x0f); // movzx eax, word [cs]
+        e_rbx(&p, 0xb7, 0, offsetof(xtem_t, s.cs));
+        e8(&p, 0xc1); // shl eax, 4
+        e8(&p, 0xe0);
+        e8(&p, 0x04);
+        e8(&p, 0x0f); // movzx ecx, word [ip]
+        e_rbx(&p, 0xb7, 1, offsetof(xtem_t, ip));
+        e8(&p, 0x01); // add eax, ecx
+        e8(&p, 0xc8);
+        e8(&p, 0x3d); // cmp eax, pc
+        e32(&p, (uint32_t)pc);
+        e_jcc(&p, 0x85, exit_0);
+      }
+    }
+    if (prefix && !is_prefix) {
+      // prefixes only apply to the next instruction
+      e_rbx(&p, 0xc7, 0, offsetof(xtem_t, def_seg));
+      e32(&p, SEG_NONE);
+      e_rbx(&p, 0xc7, 0, offsetof(xtem_t, def_rep));
+      e32(&p, REP_NOT);
+    }
+    prefix = is_prefix;
+  }
+  e_ip(&p, &dip);
+  if (prefix) {
+    e8(&p, 0xb8); // mov eax, 1
+    e32(&p, 1);
+    e8(&p, 0xe9); // jmp exit_ret
+    e32(&p, (uint32_t)(exit_ret - (p + 4)));
+  } else {
+    e8(&p, 0x48); // mov rdi, rbx
+    e8(&p, 0x89);
+    e8(&p, 0xdf);
+    e_movrax(&p, (const void*)(uintptr_t)jit_chain);
+    e8(&p, 0xff); // call rax
+    e8(&p, 0xd0);
+    e8(&p, 0x48); // test rax, rax
+    e8(&p, 0x85);
+    e8(&p, 0xc0);
+    e_jcc(&p, 0x84, exit_0);
+    e8(&p, 0xff); // jmp rax
+    e8(&p, 0xe0);
+  }
+  j->used = (size_t)(p - j->code);
+  j->blocks++;
+}
+#endif
+
+/* execute the decoded block at CS:IP, filling it on a miss
+   it stops early on a taken branch, an error, or when it got invalidated
+   with XTEM_JIT, blocks run JIT_THRESHOLD times get translated, and the
+   translation runs instead, possibly chaining to following ones
+   return : same as step(), for the last executed instruction */
+static int
+block_run(xtem_t* x)
+{
+  size_t pc;
+  block_t* b;
+  uint16_t regs[TRACE_NREGS];
+  int ret = 0;
+  // may take an interrupt, moving CS:IP
+  if (x->cycles >= x->deadline && (ret = xtem_poll(x))) {
+    return ret < 0 ? ret : 0;
+  }
+  pc = (size_t)CS * 16 + IP;
+  b = &x->bc->block[BC_HASH(pc)];
+  if (b->pc == pc) {
+    x->bc->hits++;
+  } else {
+    x->bc->misses++;
+    if (b->pc != BC_NONE) {
+      bc_drop(x, b);
+    }
+    bc_fill(x, b, pc);
+  }
+  if (b->bp && bp_stop(x, pc)) {
+    return RET_BREAK;
+  }
+#ifdef XTEM_JIT
+  if (!b->jit && !b->poll && !b->bp && x->jit->code &&
+      ++b->count >= JIT_THRESHOLD) {
+    jit_translate(x, b);
+  }
+  // translations don't trace, profile nor watch
+  if (b->jit && !TRACE(x, LIBXTEM_TRACE_INSN) && !PROF(x) && !x->watches) {
+    x->jit->chain = JIT_CHAIN;
+    ret = ((int (*)(xtem_t*))(void*)b->jit)(x);
+    if (ret != 1) {
+      x->def_seg = SEG_NONE;
+      x->def_rep = REP_NOT;
+    }
+    return ret;
+  }
+#endif
+  if (b->poll) {
+    trace_regs_get(x, regs);
+  }
+#ifdef XTEM_THREADED
+  ret = threaded_run(x, b, b->insn, pc);
+#else
+  for (int i = 0; i < b->n; i++) {
+    insn_t* in = &b->insn[i];
+    ret = insn_exec(x, in, pc);
+    pc += in->len;
+    if (ret < 0 || b->pc == BC_NONE || (size_t)CS * 16 + IP != pc ||
+        x->cycles >= x->deadline) {
+      break;
+    }
+  }
+#endif
+  if (b->poll && !ret && (size_t)CS * 16 + IP == b->pc) {
+    uint16_t now[TRACE_NREGS];
+    trace_regs_get(x, now);
+    if (!memcmp(regs, now, sizeof(regs))) {
+      xtem_skip(x); // looped to the same state, until an event changes it
+    }
+  }
+  return ret;
+}
+
+/* snapshots
+   the guest visible state, but for memory, and a copy of the RAM pages;
+   memw() marks the pages it hands out in x->dirty, so that restoring the
+   snapshot last taken or restored only copies those back */
+typedef struct
+{
+  regs_t r;
+  segs_t s;
+  uint16_t ip;
+  uint16_t fl;
+  uint8_t def_seg; // a run can stop after a prefix
+  uint8_t def_rep;
+  uint16_t pfx_ip;
+  uint64_t cycles;
+  pic_t pic[2];
+  pit_chan_t pit[3];
+  uint8_t halted;
+} xtem_state_t;
+
+typedef struct snap_s
+{
+  xtem_t* x; // taken from
+  xtem_state_t st;
+  uint8_t* ram; // MEM_SIZE, only the RAM pages are filled
+} snap_t;
+
+static void
+xtem_state_get(xtem_t* x, xtem_state_t* st)
+{
+  memcpy(st->r, x->r, sizeof(regs_t));
+  st->s = x->s;
+  st->ip = IP;
+  st->fl = flags_get(x);
+  st->def_seg = (uint8_t)x->def_seg;
+  st->def_rep = (uint8_t)x->def_rep;
+  st->pfx_ip = x->pfx_ip;
+  st->cycles = x->cycles;
+  st->halted = (uint8_t)x->halted;
+  memcpy(st->pic, x->pic, sizeof(x->pic));
+  memcpy(st->pit, x->pit, sizeof(x->pit));
+}
+
+static void
+xtem_state_set(xtem_t* x, const xtem_state_t* st)
+{
+  memcpy(x->r, st->r, sizeof(regs_t));
+  x->s = st->s;
+  IP = st->ip;
+  flags_set(x, st->fl);
+  x->def_seg = st->def_seg;
+  x->def_rep = st->def_rep;
+  x->pfx_ip = st->pfx_ip;
+  x->cycles = st->cycles; // events of other devices stay where they were
+  x->halted = st->halted;
+  memcpy(x->pic, st->pic, sizeof(x->pic));
+  memcpy(x->pit, st->pit, sizeof(x->pit));
+  pic_update(x);
+  pit_schedule(x);
+}
+
+// page p (below 1 MiB) got overwritten behind memw()'s back
+static void
+mem_replaced(xtem_t* x, size_t p)
+{
+  if (x->bc->code[p]) {
+    bc_invalidate(x, p);
+  }
+  if (p < HMA_SIZE >> PAGE_SHIFT && x->bc->code[p + (MEM_SIZE >> PAGE_SHIFT)]) {
+    bc_invalidate(x, p + (MEM_SIZE >> PAGE_SHIFT));
+  }
+}
+
+static void
+xtem_snapshot(xtem_t* x, snap_t* s)
+{
+  s->x = x;
+  xtem_state_get(x, &s->st);
+  for (size_t p = 0; p < MEM_SIZE >> PAGE_SHIFT; p++) {
+    if (x->page[p] == MEM_RAM) {
+      memcpy(s->ram + (p << PAGE_SHIFT), x->mem + (p << PAGE_SHIFT), PAGE_SIZE);
+    }
+  }
+  memset(x->dirty, 0, sizeof(x->dirty));
+  x->snap = s;
+}
+
+/* copy back the RAM pages written since s, or all of them if s isn't the
+   snapshot last taken or restored, dropping the blocks decoded from them */
+static void
+xtem_restore(xtem_t* x, snap_t* s)
+{
+  xtem_state_set(x, &s->st);
+  for (size_t i = 0; i < sizeof(x->dirty) / sizeof(x->dirty[0]); i++) {
+    uint64_t d = x->snap == s ? x->dirty[i] : ~(uint64_t)0;
+    while (d) {
+      size_t p = i * 64 + (size_t)__builtin_ctzll(d);
+      d &= d - 1;
+      if (x->page[p] != MEM_RAM) {
+        continue;
+      }
+      memcpy(x->mem + (p << PAGE_SHIFT), s->ram + (p << PAGE_SHIFT), PAGE_SIZE);
+      mem_replaced(x, p);
+    }
+  }
+  memset(x->dirty, 0, sizeof(x->dirty));
+  x->snap = s;
+}
+
+/* save-state file
+   a save_hdr_t padded to a page, then the SAVE_DATA pages in order, so that
+   they can be mapped copy-on-write from the file; the ROMs aren't saved,
+   they come from the instance loading it */
+#define SAVE_MAGIC "XTEMSAV1"
+#define SAVE_VERSION 4
+
+enum
+{
+  SAVE_NONE, // not RAM
+  SAVE_ZERO, // RAM, all zeros
+  SAVE_DATA,
+};
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  xtem_state_t st;
+  uint8_t page[MEM_SIZE >> PAGE_SHIFT]; // SAVE_*
+} save_hdr_t;
+
+static int
+page_zero(const uint8_t* p)
+{
+  return !p[0] && !memcmp(p, p + 1, PAGE_SIZE - 1);
+}
+
+static int
+xtem_save(xtem_t* x, const char* file)
+{
+  static const uint8_t pad[PAGE_SIZE];
+  save_hdr_t h = {
+    .magic = SAVE_MAGIC, .version = SAVE_VERSION, .page_size = PAGE_SIZE
+  };
+  FILE* f = fopen(file, "wb");
+  int ret = 0;
+  if (!f) {
+    perror(file);
+    return -1;
+  }
+  xtem_state_get(x, &h.st);
+  for (size_t p = 0; p < MEM_SIZE >> PAGE_SHIFT; p++) {
+    h.page[p] = x->page[p] != MEM_RAM              ? SAVE_NONE
+                : page_zero(x->mem + (p << PAGE_SHIFT)) ? SAVE_ZERO
+                                                        : SAVE_DATA;
+  }
+  if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+      fwrite(pad, PAGE_SIZE - sizeof(h), 1, f) != 1) {
+    ret = -1;
+  }
+  for (size_t p = 0; !ret && p < MEM_SIZE >> PAGE_SHIFT; p++) {
+    if (h.page[p] == SAVE_DATA &&
+        fwrite(x->mem + (p << PAGE_SHIFT), PAGE_SIZE, 1, f) != 1) {
+      ret = -1;
+    }
+  }
+  if (fclose(f) || ret) {
+    perror(file);
+    return -1;
+  }
+  return 0;
+}
+
+/* runs of RAM pages above the HMA alias are mapped from the file, or
+   anonymous when all zeros : they only get read when touched, and copied
+   when written */
+static int
+xtem_load(xtem_t* x, const char* file)
+{
+  save_hdr_t h;
+  struct stat st;
+  size_t data = 0;
+  off_t ofs = PAGE_SIZE;
+  int fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0 ||
+      pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+    perror(file);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  for (size_t p = 0; p < MEM_SIZE >> PAGE_SHIFT; p++) {
+    data += h.page[p] == SAVE_DATA;
+  }
+  if (memcmp(h.magic, SAVE_MAGIC, sizeof(h.magic)) ||
+      h.version != SAVE_VERSION || h.page_size != PAGE_SIZE ||
+      (size_t)st.st_size < (data + 1) * PAGE_SIZE) {
+    fprintf(stderr, "%s: not a version %d save-state\n", file, SAVE_VERSION);
+    close(fd);
+    return -1;
+  }
+  xtem_state_set(x, &h.st);
+  for (size_t p = 0; p < MEM_SIZE >> PAGE_SHIFT;) {
+    uint8_t* mem = x->mem + (p << PAGE_SHIFT);
+    size_t n = 1;
+    int low = p < HMA_SIZE >> PAGE_SHIFT; // the HMA has to stay an alias
+    while (p + n < MEM_SIZE >> PAGE_SHIFT && h.page[p + n] == h.page[p] &&
+           x->page[p + n] == x->page[p]) {
+      n++;
+    }
+    if (x->page[p] != MEM_RAM) {
+      // not loaded
+    } else if (h.page[p] != SAVE_DATA) { // and RAM that wasn't, now is
+      if (low || mmap(mem,
+                      n << PAGE_SHIFT,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS,
+                      -1,
+                      0) == MAP_FAILED) {
+        memset(mem, 0, n << PAGE_SHIFT);
+      }
+    } else if ((low || mmap(mem,
+                            n << PAGE_SHIFT,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_FIXED,
+                            fd,
+                            ofs) == MAP_FAILED) &&
+               pread(fd, mem, n << PAGE_SHIFT, ofs) !=
+                 (ssize_t)(n << PAGE_SHIFT)) {
+      perror(file);
+      close(fd);
+      return -1; // x is half loaded
+    }
+    for (size_t i = 0; i < n && x->page[p] == MEM_RAM; i++) {
+      mem_replaced(x, p + i);
+    }
+    if (h.page[p] == SAVE_DATA) {
+      ofs += (off_t)(n << PAGE_SHIFT);
+    }
+    p += n;
+  }
+  close(fd);
+  memset(x->dirty, 0, sizeof(x->dirty));
+  x->snap = 0;
+  return 0;
+}
+
+/* the stop reply to s and c : T05 with the watchpoint hit, if any, which
+   it clears, else S05 */
+static int
+stop_reply(xtem_t* x, char* data, size_t len)
+{
+  int type = x->watch_hit.type;
+  if (!type) {
+    return snprintf(data, len, "S05");
+  }
+  x->watch_hit.type = 0;
+  ev_deadline(x);
+  return snprintf(data,
+                  len,
+                  "T05%s:%" PRIx32 ";",
+                  type == WATCH_W   ? "watch"
+                  : type == WATCH_R ? "rwatch"
+                                    : "awatch",
+                  x->watch_hit.addr);
+}
+
+/* the CPU thread : runs the guest for an RSP server, which keeps serving
+   packets meanwhile; commands and stop replies go through single producer
+   single consumer rings, each with an eventfd counting what's queued.
+   The server only reads guest memory while the CPU thread is busy, and
+   writes guest state once it is idle again */
+#define CPU_RING 8 // commands or stop replies queued, a power of 2
+#define CPU_STOP_SIZE 64
+
+enum
+{
+  CPU_CONT = 1,
+  CPU_STEP,
+  CPU_QUIT,
+};
+
+typedef struct
+{
+  xtem_t* x;
+  pthread_t thread;
+  int on;          // thread started
+  int wake;        // eventfd, a count of the commands queued
+  int stopped;     // eventfd, non blocking, of the stop replies queued
+  atomic_int intr; // stop the current or next CPU_CONT
+  atomic_int busy; // commands posted but not replied to yet
+  int cmd[CPU_RING];
+  atomic_uint cmd_head, cmd_tail;
+  struct
+  {
+    int ret; // of the last step() or block_run()
+    char reply[CPU_STOP_SIZE];
+  } stop[CPU_RING];
+  atomic_uint stop_head, stop_tail;
+} cpu_t;
+
+static void*
+cpu_main(void* c_)
+{
+  cpu_t* c = (cpu_t*)c_;
+  uint64_t one;
+  while (read(c->wake, &one, sizeof(one)) == sizeof(one)) {
+    unsigned tail = atomic_load_explicit(&c->cmd_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&c->stop_head, memory_order_relaxed);
+    int cmd = c->cmd[tail % CPU_RING];
+    int ret = 0;
+    atomic_store_explicit(&c->cmd_tail, tail + 1, memory_order_release);
+    if (cmd == CPU_QUIT) {
+      break;
+    }
+    do {
+      if (cmd == CPU_CONT &&
+          atomic_exchange_explicit(&c->intr, 0, memory_order_relaxed)) {
         break;
+      }
+      ret = cmd == CPU_STEP ? step(c->x) : block_run(c->x);
+    } while (cmd == CPU_STEP ? ret == RET_PREFIX : ret >= 0);
+    c->stop[head % CPU_RING].ret = ret;
+    stop_reply(c->x, c->stop[head % CPU_RING].reply, CPU_STOP_SIZE);
+    atomic_store_explicit(&c->stop_head, head + 1, memory_order_release);
+    atomic_fetch_sub_explicit(&c->busy, 1, memory_order_release);
+    one = 1;
+    if (write(c->stopped, &one, sizeof(one)) != sizeof(one)) {
+      perror(__func__);
     }
-    break;
   }
-  if (!pfx_seg) {
-    x->def_seg = SEG_DS;
-  } else {
-    if (!ret) {
-      ret = 1;
+  return 0;
+}
+
+static int
+cpu_init(cpu_t* c, xtem_t* x)
+{
+  c->x = x;
+  c->wake = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+  c->stopped = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE | EFD_NONBLOCK);
+  if (c->wake < 0 || c->stopped < 0) {
+    perror(__func__);
+    return -1;
+  }
+  return 0;
+}
+
+/* queue cmd for the CPU thread, started on the first one
+   return : <0 if the rings are full */
+static int
+cpu_post(cpu_t* c, int cmd)
+{
+  unsigned head = atomic_load_explicit(&c->cmd_head, memory_order_relaxed);
+  uint64_t one = 1;
+  if (!c->on) {
+    if (pthread_create(&c->thread, 0, cpu_main, c)) {
+      return -1;
     }
+    c->on = 1;
   }
-  if (!pfx_rep) {
-    x->def_rep = REP_NOT;
-  } else {
-    if (!ret) {
-      ret = 1;
+  // each command queued or running gets a reply, not to overrun unread ones
+  if ((unsigned)atomic_load_explicit(&c->busy, memory_order_relaxed) +
+        atomic_load_explicit(&c->stop_head, memory_order_acquire) -
+        atomic_load_explicit(&c->stop_tail, memory_order_relaxed) >=
+      CPU_RING) {
+    return -1;
+  }
+  if (cmd == CPU_CONT) {
+    atomic_store_explicit(&c->intr, 0, memory_order_relaxed);
+  }
+  c->cmd[head % CPU_RING] = cmd;
+  atomic_fetch_add_explicit(&c->busy, 1, memory_order_relaxed);
+  atomic_store_explicit(&c->cmd_head, head + 1, memory_order_release);
+  return write(c->wake, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+// whether the CPU thread runs the guest, or has stop replies queued
+static int
+cpu_busy(cpu_t* c)
+{
+  return atomic_load_explicit(&c->busy, memory_order_acquire) ||
+         atomic_load_explicit(&c->stop_tail, memory_order_relaxed) !=
+           atomic_load_explicit(&c->stop_head, memory_order_acquire);
+}
+
+/* the next stop reply in reply, waiting for it if wait is set
+   return : the ret of the run, or RET_OK with no reply while still busy */
+static int
+cpu_stop(cpu_t* c, char* reply, size_t len, int wait)
+{
+  struct pollfd p = { .fd = c->stopped, .events = POLLIN };
+  uint64_t one;
+  unsigned tail;
+  int ret;
+  *reply = 0;
+  while (read(c->stopped, &one, sizeof(one)) != sizeof(one)) {
+    if (!wait) {
+      return RET_OK;
     }
+    poll(&p, 1, -1);
   }
+  tail = atomic_load_explicit(&c->stop_tail, memory_order_relaxed);
+  ret = c->stop[tail % CPU_RING].ret;
+  snprintf(reply, len, "%s", c->stop[tail % CPU_RING].reply);
+  atomic_store_explicit(&c->stop_tail, tail + 1, memory_order_release);
   return ret;
 }
 
+static void
+cpu_cleanup(cpu_t* c)
+{
+  char reply[CPU_STOP_SIZE];
+  if (!c->x) {
+    return; // not initialized
+  }
+  if (c->on) {
+    atomic_store_explicit(&c->intr, 1, memory_order_relaxed);
+    while (cpu_busy(c)) {
+      cpu_stop(c, reply, sizeof(reply), 1);
+    }
+    cpu_post(c, CPU_QUIT);
+    pthread_join(c->thread, 0);
+  }
+  if (c->wake >= 0) {
+    close(c->wake);
+  }
+  if (c->stopped >= 0) {
+    close(c->stopped);
+  }
+}
+
 typedef struct
 {
   xtem_t* x;
+  cpu_t cpu;
 } rsp_t;
 
 void*
 xtem_rsp_init()
 {
   rsp_t* r = calloc(1, sizeof(rsp_t));
-  r->x = xtem_init();
+  r->x = xtem_init(0);
+  if (!r->x || cpu_init(&r->cpu, r->x) < 0) {
+    xtem_rsp_cleanup(r);
+    return 0;
+  }
   return r;
 }
 
@@ -848,122 +3729,653 @@ xtem_rsp_cleanup(void* r_)
 {
   rsp_t* r = (rsp_t*)r_;
   if (r) {
+    cpu_cleanup(&r->cpu);
     xtem_cleanup(r->x);
     free(r);
   }
   return 0;
 }
 
+// the guest state can't be written while the CPU thread runs it
+static int
+rsp_busy(rsp_t* r)
+{
+  return cpu_busy(&r->cpu);
+}
+
+/* s and c only start the CPU thread, xtem_rsp_stop() waits for the reply
+   return : <0 while it runs */
 int
 xtem_rsp_s(void* r_)
 {
   rsp_t* r = (rsp_t*)r_;
-  while (1) {
-    int n = step(r->x);
-    if (n == 1) {
-      continue; // was a prefix
-    } else if (n == 0) {
-      break; // was an atomic insn
+  return rsp_busy(r) ? -1 : cpu_post(&r->cpu, CPU_STEP);
+}
+
+int
+xtem_rsp_c(void* r_)
+{
+  rsp_t* r = (rsp_t*)r_;
+  return rsp_busy(r) ? -1 : cpu_post(&r->cpu, CPU_CONT);
+}
+
+// return : <0 while the CPU thread runs, flags_get() writes FL
+int
+xtem_rsp_g(void* r_, char* data)
+{
+  rsp_t* r = (rsp_t*)r_;
+  if (rsp_busy(r)) {
+    return -1;
+  }
+  int len = (int)strlen(data);
+  //	printf("len=%d\n", len);
+  int pos = 0;
+  do {
+#define WR_REG16(reg16)                                                        \
+  do {                                                                         \
+    if (pos + 2 > len)                                                         \
+      break;                                                                   \
+    pos += snprintf(data + pos, 2 + 1, "%02" PRIx8, reg16 & 0xff);             \
+    if (pos + 2 > len)                                                         \
+      break;                                                                   \
+    pos += snprintf(data + pos, 2 + 1, "%02" PRIx8, reg16 >> 8);               \
+    if (pos + 4 > len)                                                         \
+      break;                                                                   \
+    pos += snprintf(data + pos, 4 + 1, "%04" PRIx16, 0);                       \
+  } while (0)
+
+    WR_REG16(r->AX);
+    WR_REG16(r->CX);
+    WR_REG16(r->DX);
+    WR_REG16(r->BX);
+    WR_REG16(r->SP);
+    WR_REG16(r->BP);
+    WR_REG16(r->SI);
+    WR_REG16(r->DI);
+    WR_REG16(r->IP);
+    WR_REG16(flags_get(r->x));
+    WR_REG16(r->CS);
+    WR_REG16(r->SS);
+    WR_REG16(r->DS);
+    WR_REG16(r->ES);
+    WR_REG16(0); // fs
+    WR_REG16(0); // gs
+  } while (0);
+  for (; pos < len; pos++) {
+    data[pos] = '0';
+  }
+  // printf("Hello data=%s\n", data);
+  //	printf("Hello pos=%d data=%s\n", pos, data);
+  // getchar();
+  return 42;
+}
+
+static const char hex_digit[16] = "0123456789abcdef";
+
+static void
+hex_put(char* d, const uint8_t* s, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    d[2 * i] = hex_digit[s[i] >> 4];
+    d[2 * i + 1] = hex_digit[s[i] & 0xf];
+  }
+}
+
+int
+xtem_rsp_m(void* r_, char* data, size_t addr, size_t len)
+{
+  rsp_t* r = (rsp_t*)r_;
+  for (size_t i = 0; i < len;) {
+    uint8_t* buf = 0;
+    size_t n = len - i;
+    memr(r->x, (void**)&buf, &n, addr + i);
+    hex_put(data + 2 * i, buf, n);
+    i += n;
+  }
+  return 42;
+}
+
+static int
+hex_nibble(char c)
+{
+  return c >= '0' && c <= '9'   ? c - '0'
+         : c >= 'a' && c <= 'f' ? c - 'a' + 10
+         : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                : -1;
+}
+
+// return : n bytes decoded from the hex digits at s, <0 on a bad digit
+static int
+hex_get(uint8_t* d, const char* s, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    int h = hex_nibble(s[2 * i]);
+    int l = hex_nibble(s[2 * i + 1]);
+    if (h < 0 || l < 0) {
+      return -1;
+    }
+    d[i] = (uint8_t)(h << 4 | l);
+  }
+  return 0;
+}
+
+/* gdb's i386 register n, as in the g packet : AX CX DX BX SP BP SI DI, IP,
+   FLAGS, CS SS DS ES, and FS GS reading as 0, writes to them are dropped
+   return : <0 for the registers past those */
+static int
+rsp_reg(xtem_t* x, int n, uint16_t* v, int wr)
+{
+  static const int seg[4] = { 1, 2, 3, 0 }; // CS SS DS ES, in sreg() order
+  uint16_t* p;
+  if (n < 0 || n > 15) {
+    return -1;
+  }
+  if (n == 9) {
+    if (wr) {
+      flags_pop(x, *v); // may enable a pending IRQ
     } else {
-      printf("%s: an error ? n=%d\n", __func__, n);
-      // exit(1); // was an error
-      return n;
+      *v = flags_get(x);
+    }
+    return 0;
+  }
+  p = n < 8 ? reg16(x, n) : n == 8 ? &IP : n < 14 ? sreg(x, seg[n - 10]) : 0;
+  if (wr && p) {
+    if ((n == 8 || n == 10) && *p != *v) {
+      x->halted = 0; // runs from where it was moved to
     }
+    *p = *v;
+  } else if (!wr) {
+    *v = p ? *p : 0;
+  }
+  return 0;
+}
+
+// register n as 8 hex digits
+// return : -1 if there's no such register, -2 while the CPU thread runs
+int
+xtem_rsp_p(void* r_, char* data, int n)
+{
+  rsp_t* r = (rsp_t*)r_;
+  uint16_t v;
+  uint8_t b[4] = { 0 };
+  if (rsp_busy(r)) {
+    return -2;
+  }
+  if (rsp_reg(r->x, n, &v, 0) < 0) {
+    return -1;
   }
+  b[0] = (uint8_t)v;
+  b[1] = (uint8_t)(v >> 8);
+  hex_put(data, b, sizeof(b));
   return 42;
 }
 
+// set register n from the 8 hex digits at data
 int
-xtem_rsp_c(void* r_)
+xtem_rsp_P(void* r_, int n, const char* data)
 {
   rsp_t* r = (rsp_t*)r_;
-  int ret = 0;
-  while (1) {
-    ret = step(r->x);
-    if (ret < 0) {
-      break;
+  uint8_t b[4];
+  uint16_t v;
+  if (rsp_busy(r) || strlen(data) < 2 * sizeof(b) ||
+      hex_get(b, data, sizeof(b)) < 0) {
+    return -1;
+  }
+  v = (uint16_t)(b[0] | b[1] << 8);
+  return rsp_reg(r->x, n, &v, 1) < 0 ? -1 : 42;
+}
+
+// set the registers from a g packet layout, those past GS are ignored
+int
+xtem_rsp_G(void* r_, const char* data)
+{
+  if (strlen(data) < 16 * 8) {
+    return -1;
+  }
+  for (int n = 0; n < 16; n++) {
+    if (xtem_rsp_P(r_, n, data + 8 * n) < 0) {
+      return -1;
+    }
+  }
+  return 42;
+}
+
+// write len bytes from their hex digits, through memw() like the guest
+int
+xtem_rsp_M(void* r_, const char* data, size_t addr, size_t len)
+{
+  rsp_t* r = (rsp_t*)r_;
+  uint8_t b[256];
+  if (rsp_busy(r) || strlen(data) < len * 2) {
+    return -1;
+  }
+  for (size_t i = 0; i < len;) {
+    size_t n = len - i < sizeof(b) ? len - i : sizeof(b);
+    if (hex_get(b, data + 2 * i, n) < 0) {
+      return -1;
+    }
+    mem_store(r->x, b, n, addr + i);
+    i += n;
+  }
+  return 42;
+}
+
+/* Z and z packets, type 0 (software) and 1 (hardware) breakpoints are
+   the same, their kind is ignored; 2, 3 and 4 are write, read and access
+   watchpoints on kind bytes
+   return : -2 for the types not supported */
+int
+xtem_rsp_Z(void* r_, int type, size_t addr, size_t kind, int on)
+{
+  static const int watch[] = { WATCH_W, WATCH_R, WATCH_W | WATCH_R };
+  rsp_t* r = (rsp_t*)r_;
+  int ret;
+  if (type < 0 || type > 4) {
+    return -2;
+  }
+  if (rsp_busy(r)) {
+    return -1;
+  }
+  ret = type < 2 ? xtem_bp(r->x, addr, on)
+                 : xtem_watch(r->x, addr, kind, watch[type - 2], on);
+  return ret < 0 ? -1 : 42;
+}
+
+/* the stop reply to s and c, waiting for it : see stop_reply(), which also
+   answers when nothing runs */
+int
+xtem_rsp_stop(void* r_, char* data, size_t len)
+{
+  rsp_t* r = (rsp_t*)r_;
+  if (!cpu_busy(&r->cpu)) {
+    return stop_reply(r->x, data, len);
+  }
+  cpu_stop(&r->cpu, data, len, 1);
+  return (int)strlen(data);
+}
+
+// readable while a stop reply is queued, for select() with the RSP socket
+int
+xtem_rsp_fd(void* r_)
+{
+  rsp_t* r = (rsp_t*)r_;
+  return r->cpu.stopped;
+}
+
+// gdb's ^C : stop the CPU thread, its stop reply follows
+int
+xtem_rsp_intr(void* r_)
+{
+  rsp_t* r = (rsp_t*)r_;
+  atomic_store_explicit(&r->cpu.intr, 1, memory_order_relaxed);
+  return 0;
+}
+
+int
+xtem_rsp_x(void* r_, uint8_t* data, size_t addr, size_t len)
+{
+  rsp_t* r = (rsp_t*)r_;
+  mem_fetch(r->x, data, len, addr);
+  return 42;
+}
+
+// writes to ROM or unmapped memory are dropped
+int
+xtem_rsp_X(void* r_, const uint8_t* data, size_t addr, size_t len)
+{
+  rsp_t* r = (rsp_t*)r_;
+  if (rsp_busy(r)) {
+    return -1;
+  }
+  mem_store(r->x, data, len, addr);
+  return 42;
+}
+
+/* the qXfer:memory-map:read document : the RAM and ROM runs of pages, so
+   that gdb knows what is there and what is read-only
+   return : its length, truncated to len - 1 */
+int
+xtem_rsp_map(void* r_, char* xml, size_t len)
+{
+  rsp_t* r = (rsp_t*)r_;
+  xtem_t* x = r->x;
+  size_t pos = 0;
+#define OUT(...)                                                               \
+  do {                                                                         \
+    if (pos < len) {                                                           \
+      pos += (size_t)snprintf(xml + pos, len - pos, __VA_ARGS__);              \
+    }                                                                          \
+  } while (0)
+  OUT("<?xml version=\"1.0\"?>\n"
+      "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map "
+      "V1.0//EN\" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+      "<memory-map>\n");
+  for (size_t p = 0, q; p < PAGES; p = q) {
+    for (q = p + 1; q < PAGES && x->page[q] == x->page[p]; q++) {
+    }
+    if (x->page[p] == MEM_RAM || x->page[p] == MEM_ROM) {
+      OUT("<memory type=\"%s\" start=\"0x%zx\" length=\"0x%zx\"/>\n",
+          x->page[p] == MEM_RAM ? "ram" : "rom",
+          p << PAGE_SHIFT,
+          (q - p) << PAGE_SHIFT);
+    }
+  }
+  OUT("</memory-map>\n");
+#undef OUT
+  return (int)(pos < len ? pos : len - 1);
+}
+
+/* turn the profiler on or off, keeping the counts
+   return : previous state, <0 if it isn't built in or out of memory */
+static int
+prof_enable(xtem_t* x, int on)
+{
+  prof_t* p = &x->prof;
+  int prev = p->on;
+#ifndef XTEM_PROF
+  return -1;
+#endif
+  if (on && !p->pc) {
+    p->pc = calloc(PROF_PCS, sizeof(*p->pc));
+    p->node = calloc(PROF_NODES, sizeof(*p->node));
+    p->hash = calloc(PROF_HASH, sizeof(*p->hash));
+    if (!p->pc || !p->node || !p->hash) {
+      free(p->pc);
+      free(p->node);
+      free(p->hash);
+      p->pc = 0;
+      return -1;
+    }
+    p->nodes = 1;
+  }
+  p->on = !!on;
+  return prev;
+}
+
+static void
+prof_reset(xtem_t* x)
+{
+  prof_t* p = &x->prof;
+  if (p->pc) {
+    memset(p->pc, 0, PROF_PCS * sizeof(*p->pc));
+    memset(p->node, 0, PROF_NODES * sizeof(*p->node));
+    memset(p->hash, 0, PROF_HASH * sizeof(*p->hash));
+    p->nodes = 1;
+  }
+  memset(p->op, 0, sizeof(p->op));
+  p->cur = 0;
+  p->lost = 0;
+}
+
+/* indices of the (up to) n largest of the m counts, largest first
+   return : how many are non zero */
+static int
+prof_top(const uint64_t* counts, size_t m, size_t* top, int n)
+{
+  int k = 0;
+  for (size_t i = 0; i < m; i++) {
+    int j;
+    if (!counts[i] || (k == n && counts[i] <= counts[top[n - 1]])) {
+      continue;
+    }
+    for (j = k < n ? k++ : n - 1; j > 0 && counts[top[j - 1]] < counts[i];
+         j--) {
+      top[j] = top[j - 1];
+    }
+    top[j] = i;
+  }
+  return k;
+}
+
+/* folded stacks, one line per calling context : the linear addresses
+   entered, outermost first, and the instructions run there */
+static int
+prof_dump(xtem_t* x, const char* file)
+{
+  prof_t* p = &x->prof;
+  FILE* f;
+  if (!p->pc) {
+    return -1;
+  }
+  f = fopen(file, "w");
+  if (!f) {
+    perror(file);
+    return -1;
+  }
+  for (int i = 0; i < p->nodes; i++) {
+    uint32_t stack[PROF_DEPTH + 1];
+    int d = 0;
+    if (!p->node[i].count) {
+      continue;
+    }
+    for (int n = i; n; n = p->node[n].parent) {
+      stack[d++] = p->node[n].addr;
+    }
+    fputs("xtem", f);
+    while (d) {
+      fprintf(f, ";%05" PRIx32, stack[--d]);
+    }
+    fprintf(f, " %" PRIu64 "\n", p->node[i].count);
+  }
+  fclose(f);
+  return 0;
+}
+
+static uint64_t
+prof_total(const prof_t* p)
+{
+  uint64_t total = 0;
+  for (int i = 0; i < 256; i++) {
+    total += p->op[i];
+  }
+  return total;
+}
+
+#define MONITOR_TOP 64
+
+/* gdb monitor commands, output in out, as text
+   return : 0, -1 for unknown commands or errors */
+static int
+xtem_monitor(xtem_t* x, const char* cmd, char* out, size_t len)
+{
+  prof_t* p = &x->prof;
+  char arg[256] = "";
+  size_t top[MONITOR_TOP];
+  size_t pos = 0;
+  uint64_t total = 0;
+  int n = 20;
+  int k;
+#define OUT(...)                                                               \
+  do {                                                                         \
+    if (pos < len) {                                                           \
+      pos += (size_t)snprintf(out + pos, len - pos, __VA_ARGS__);              \
+    }                                                                          \
+  } while (0)
+  out[0] = 0;
+  if (!strcmp(cmd, "stats")) {
+    OUT("insns %" PRIu64 ", cycles %" PRIu64 " (%" PRIu64 " idle)\n"
+        "blocks %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+        " invalidations\n",
+        x->bc->insns,
+        x->cycles,
+        x->idle,
+        x->bc->hits,
+        x->bc->misses,
+        x->bc->invalidations);
+    return 0;
+  }
+  if (strncmp(cmd, "prof", 4)) {
+    OUT("stats             : instructions, cycles, block cache counters\n"
+        "prof on|off|reset : start, stop, clear the hot-spot profile\n"
+        "prof pc|op [n]    : top n PCs or opcodes, 20 by default\n"
+        "prof dump file    : write the folded stacks, for flamegraph.pl\n");
+    return strcmp(cmd, "help") ? -1 : 0;
+  }
+  sscanf(cmd + 4, "%255s %d", arg, &n);
+  if (n < 1 || n > MONITOR_TOP) {
+    n = MONITOR_TOP;
+  }
+  total = prof_total(p);
+  if (!strcmp(arg, "on") || !strcmp(arg, "off")) {
+    if (prof_enable(x, !strcmp(arg, "on")) < 0) {
+      OUT("profiler not built in, or out of memory (make PROF=1)\n");
+      return -1;
+    }
+  } else if (!strcmp(arg, "reset")) {
+    prof_reset(x);
+  } else if (!strcmp(arg, "pc") && p->pc) {
+    k = prof_top(p->pc, PROF_PCS, top, n);
+    for (int i = 0; i < k; i++) {
+      OUT("%05zx %12" PRIu64 " %5.1f%%\n",
+          top[i],
+          p->pc[top[i]],
+          100.0 * (double)p->pc[top[i]] / (double)total);
+    }
+  } else if (!strcmp(arg, "op")) {
+    k = prof_top(p->op, 256, top, n);
+    for (int i = 0; i < k; i++) {
+      OUT("%02zx %-6s %12" PRIu64 " %5.1f%%\n",
+          top[i],
+          op_table[top[i]].name,
+          p->op[top[i]],
+          100.0 * (double)p->op[top[i]] / (double)total);
+    }
+  } else if (!strcmp(arg, "dump")) {
+    sscanf(cmd, "prof dump %255s", arg);
+    if (prof_dump(x, arg) < 0) {
+      OUT("nothing profiled, or can't write %s\n", arg);
+      return -1;
     }
+  } else if (*arg && strcmp(arg, "pc")) {
+    OUT("unknown : prof %s\n", arg);
+    return -1;
   }
-  return ret;
+  OUT("prof %s, %" PRIu64 " insns in %d contexts, %" PRIu32 " calls lost\n",
+      p->on ? "on" : "off",
+      prof_total(p),
+      p->nodes,
+      p->lost);
+#undef OUT
+  return 0;
 }
 
-int
-xtem_rsp_g(void* r_, char* data)
+/* whether the monitor command only reads counters, and so can run while
+   the CPU thread runs the guest (they may be a little behind then) */
+static int
+monitor_ro(const char* cmd)
 {
-  rsp_t* r = (rsp_t*)r_;
-  int len = (int)strlen(data);
-  //	printf("len=%d\n", len);
-  int pos = 0;
-  do {
-#define WR_REG16(reg16)                                                        \
-  do {                                                                         \
-    if (pos + 2 > len)                                                         \
-      break;                                                                   \
-    pos += snprintf(data + pos, 2 + 1, "%02" PRIx8, reg16 & 0xff);             \
-    if (pos + 2 > len)                                                         \
-      break;                                                                   \
-    pos += snprintf(data + pos, 2 + 1, "%02" PRIx8, reg16 >> 8);               \
-    if (pos + 4 > len)                                                         \
-      break;                                                                   \
-    pos += snprintf(data + pos, 4 + 1, "%04" PRIx16, 0);                       \
-  } while (0)
-
-    WR_REG16(r->AX);
-    WR_REG16(r->CX);
-    WR_REG16(r->DX);
-    WR_REG16(r->BX);
-    WR_REG16(r->SP);
-    WR_REG16(r->BP);
-    WR_REG16(r->SI);
-    WR_REG16(r->DI);
-    WR_REG16(r->IP);
-    WR_REG16(r->FL);
-    WR_REG16(r->CS);
-    WR_REG16(r->SS);
-    WR_REG16(r->DS);
-    WR_REG16(r->ES);
-    WR_REG16(0); // fs
-    WR_REG16(0); // gs
-  } while (0);
-  for (; pos < len; pos++) {
-    data[pos] = '0';
+  char arg[16] = "";
+  if (strncmp(cmd, "prof", 4)) {
+    return 1; // stats, help
   }
-  // printf("Hello data=%s\n", data);
-  //	printf("Hello pos=%d data=%s\n", pos, data);
-  // getchar();
-  return 42;
+  sscanf(cmd + 4, "%15s", arg);
+  return !*arg || !strcmp(arg, "pc") || !strcmp(arg, "op");
 }
 
+// qRcmd, decoded : see xtem_monitor()
 int
-xtem_rsp_m(void* r_, char* data, size_t addr, size_t len)
+xtem_rsp_monitor(void* r_, const char* cmd, char* out, size_t len)
 {
   rsp_t* r = (rsp_t*)r_;
-  unsigned char* buf = 0;
-  memr(r->x, (void**)&buf, &len, addr);
-  if (buf) {
-    for (size_t i = 0; i < len; i++) {
-      sprintf(data + 2 * i, "%02x", buf[i]);
-    }
+  if (rsp_busy(r) && !monitor_ro(cmd)) {
+    snprintf(out, len, "running, only stats and prof [pc|op] until stopped\n");
+    return -1;
   }
-  return 42;
+  return xtem_monitor(r->x, cmd, out, len);
 }
 
 #include "librspd.h"
+
+/* a library handle
+   all the emulation state hangs from it; intr is set from other threads
+   (libxtem_interrupt()), and only polled with relaxed loads by the run
+   loops, at block boundaries. With an RSP port, c runs on the CPU thread
+   (see cpu_t) and the notify thread sends its stop reply, so that the
+   server keeps reading packets, ^C and k included, meanwhile */
 typedef struct
 {
   void* x;
   void* r;
-  int intr;
-  int kill;
+  atomic_int intr;
+  rsp_t rsp; // for the xtem_rsp_* calls : x too, and the CPU thread
+  pthread_t notify;
+  int quit; // eventfd, stops the notify thread
+  pthread_mutex_t send; // the notify thread sends along the server's thread
+  int xlen; // register set gdb expects, 32 or 64 bits
+  char* buf; // RSP replies, grown as needed
+  size_t buf_size;
 } lx_t;
 
-static int xlen = 32;
+// the reply buffer, of at least len bytes
+static char*
+lx_buf(lx_t* lx, size_t len)
+{
+  if (len > lx->buf_size) {
+    char* buf = realloc(lx->buf, len);
+    if (!buf) {
+      return 0;
+    }
+    lx->buf = buf;
+    lx->buf_size = len;
+  }
+  return lx->buf;
+}
+
+// test and clear lx->intr
+static int
+lx_intr(lx_t* lx)
+{
+  if (!atomic_load_explicit(&lx->intr, memory_order_relaxed)) {
+    return 0;
+  }
+  atomic_store_explicit(&lx->intr, 0, memory_order_relaxed);
+  return 1;
+}
+
+static int
+lx_send(lx_t* lx, const char* data, size_t len)
+{
+  int ret;
+  pthread_mutex_lock(&lx->send);
+  ret = rsp_send(lx->r, data, len);
+  pthread_mutex_unlock(&lx->send);
+  return ret;
+}
+
+// sends the stop replies of the CPU thread as they are queued, until quit
+static void*
+lx_notify(void* lx_)
+{
+  lx_t* lx = (lx_t*)lx_;
+  struct pollfd p[2] = {
+    { .fd = lx->rsp.cpu.stopped, .events = POLLIN },
+    { .fd = lx->quit, .events = POLLIN },
+  };
+  char reply[CPU_STOP_SIZE];
+  while (!p[1].revents) {
+    if (poll(p, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(__func__);
+      break;
+    }
+    if (p[0].revents) {
+      cpu_stop(&lx->rsp.cpu, reply, sizeof(reply), 0);
+      if (*reply) {
+        lx_send(lx, reply, strlen(reply));
+      }
+    }
+  }
+  return 0;
+}
+
 static int
 rsp_question(void* lx_)
 {
   lx_t* lx = (lx_t*)lx_;
   char* buf = "S05";
-  rsp_send(lx->r, buf, strlen(buf));
+  lx_send(lx, buf, strlen(buf));
   return 0;
 }
 
@@ -975,81 +4387,66 @@ rsp_get_regs(void* lx_)
 {
   lx_t* lx = (lx_t*)lx_;
   char buf[LEN64 + 1];
-  size_t len = xlen == 64 ? LEN64 : LEN32;
+  size_t len = lx->xlen == 64 ? LEN64 : LEN32;
   memset(buf, '0', len);
-  xtem_rsp_g(&lx->x, buf);
-  rsp_send(lx->r, buf, len);
+  if (xtem_rsp_g(&lx->rsp, buf) < 0) {
+    lx_send(lx, "E01", 3);
+    return 0;
+  }
+  lx_send(lx, buf, len);
   return 0;
 }
 
 static int
-rsp_read_mem(void* lx_, size_t addr, size_t len_)
+rsp_read_mem(void* lx_, size_t addr, size_t len)
 {
   lx_t* lx = (lx_t*)lx_;
-  size_t len = len_;
-  char* data = malloc(len * 2 + 1);
-  memset(data, '0', len * 2);
-  xtem_rsp_m(&lx->x, data, addr, len);
-  rsp_send(lx->r, data, len * 2);
-  free(data);
+  char* data = lx_buf(lx, len * 2);
+  if (!data) {
+    lx_send(lx, "E01", 3);
+    return 0;
+  }
+  xtem_rsp_m(&lx->rsp, data, addr, len);
+  lx_send(lx, data, len * 2);
   return 0;
 }
 
+/* one instruction, on the server's thread as librspd sends the reply once
+   stepi returns; nothing while a continue runs */
 static int
 rsp_stepi(void* lx_)
 {
   lx_t* lx = (lx_t*)lx_;
-  int ret = 0;
-  while (1) {
-    if (lx->intr) {
-      lx->intr = 0;
-      break;
-    }
-    //printf("%s: doing step..\n", __func__);
-    int n = step(lx->x);
-    //printf("%s: step returned %d\n", __func__, n);
-    if (n == 1) {
-      continue; // was a prefix
-    } else if (n == 0) {
-      ret = 1;
-      break; // was an atomic insn
-    } else {
-      //printf("%s: an error ? n=%d\n", __func__, n);
-      // exit(1); // was an error
-      ret = n;
-      break;
-    }
+  char reply[CPU_STOP_SIZE];
+  int ret;
+  if (cpu_busy(&lx->rsp.cpu)) {
+    return 0;
   }
-  return ret;
+  do {
+    ret = step(lx->x);
+  } while (ret == RET_PREFIX);
+  // librspd replies S05 : drop the watchpoint hit, not to stop on it again
+  stop_reply(lx->x, reply, sizeof(reply));
+  return ret == RET_OK ? 1 : ret;
 }
 
+// starts the CPU thread, lx_notify() sends the stop reply
 static int
 rsp_cont(void* lx_)
 {
   lx_t* lx = (lx_t*)lx_;
-  int ret = 0;
-  while (1) {
-    if (lx->intr) {
-      lx->intr = 0;
-      break;
-    }
-    ret = step(lx->x);
-    if (ret < 0) {
-      break;
-    }
+  if (cpu_busy(&lx->rsp.cpu)) {
+    return 0;
   }
-  rsp_question(lx_);
-  //printf("%s: returning %d\n", __func__, ret);
-  return ret;
+  return cpu_post(&lx->rsp.cpu, CPU_CONT);
 }
 
+// stops a running continue, the server then returns
 static int
 rsp_kill(void* lx_)
 {
   lx_t* lx = (lx_t*)lx_;
-
-  printf("%s: KILL!!!!!!!!!!!!!\n", __func__);
-  lx->kill = 1;
+  atomic_store_explicit(&lx->rsp.cpu.intr, 1, memory_order_relaxed);
   return -1;
 }
 
@@ -1059,7 +4456,7 @@ rsp_intr(void* lx_)
   lx_t* lx = (lx_t*)lx_;
 
   printf("%s: INTR!!!!!!!!!!!!!\n", __func__);
-  lx->intr = 1;
+  atomic_store_explicit(&lx->rsp.cpu.intr, 1, memory_order_relaxed);
   rsp_stopped(lx->r);
   return 0;
 }
@@ -1089,11 +4486,35 @@ lx_dumpregs(xtem_t* x)
 
 void*
 libxtem_init(int rsp_port)
+{
+  return libxtem_init_roms(rsp_port, 0);
+}
+
+void*
+libxtem_init_roms(int rsp_port, const libxtem_rom_t* roms)
 {
   lx_t* res = calloc(1, sizeof(lx_t));
   printf("%s: lx=%p\n", __func__, res);
-  res->x = xtem_init();
+  res->x = xtem_init(roms);
+  if (!res->x) {
+    free(res);
+    return 0;
+  }
+  res->rsp.x = res->x;
+  res->quit = -1;
+  res->xlen = 32;
   if (rsp_port) {
+    res->quit = eventfd(0, EFD_CLOEXEC);
+    if (res->quit < 0 || cpu_init(&res->rsp.cpu, res->x) < 0 ||
+        pthread_mutex_init(&res->send, 0)) {
+      libxtem_cleanup(res);
+      return 0;
+    }
+    if (pthread_create(&res->notify, 0, lx_notify, res)) {
+      pthread_mutex_destroy(&res->send);
+      libxtem_cleanup(res);
+      return 0;
+    }
     res->r = rsp_init(&(rsp_init_t){
       .user = res,
       .port = rsp_port,
@@ -1115,12 +4536,315 @@ libxtem_cleanup(void* lx_)
 {
   lx_t* lx = (lx_t*)lx_;
   if (lx) {
+    uint64_t one = 1;
+    if (lx->notify) {
+      if (write(lx->quit, &one, sizeof(one)) != sizeof(one)) {
+        perror(__func__);
+      }
+      pthread_join(lx->notify, 0);
+      pthread_mutex_destroy(&lx->send);
+    }
+    if (lx->quit >= 0) {
+      close(lx->quit);
+    }
     rsp_cleanup(lx->r);
+    cpu_cleanup(&lx->rsp.cpu);
     xtem_cleanup(lx->x);
+    free(lx->buf);
+    free(lx);
+  }
+  return 0;
+}
+
+int
+libxtem_stats(void* lx_, libxtem_stats_t* stats)
+{
+  lx_t* lx = (lx_t*)lx_;
+  xtem_t* x = lx->x;
+  stats->bc_hits = x->bc->hits;
+  stats->bc_misses = x->bc->misses;
+  stats->bc_invalidations = x->bc->invalidations;
+  stats->insns = x->bc->insns;
+  stats->cycles = x->cycles;
+  stats->idle_cycles = x->idle;
+#ifdef XTEM_JIT
+  stats->jit_blocks = x->jit->blocks;
+  stats->jit_flushes = x->jit->flushes;
+#else
+  stats->jit_blocks = 0;
+  stats->jit_flushes = 0;
+#endif
+  return 0;
+}
+
+#ifdef XTEM_JIT
+#define RUN_BLOCK_MAX (BC_INSNS * (JIT_CHAIN + 1))
+#else
+#define RUN_BLOCK_MAX BC_INSNS
+#endif
+
+/* run blocks, then single instructions once the instruction budget left is
+   less than what a block_run() may execute, so that it is never exceeded;
+   the cycle budget is a deadline, as events are */
+libxtem_exit_t
+libxtem_run(void* lx_, uint64_t max_insns, uint64_t max_cycles)
+{
+  lx_t* lx = (lx_t*)lx_;
+  xtem_t* x = lx->x;
+  libxtem_exit_t e = { 0 };
+  uint64_t start = x->bc->insns;
+  uint64_t start_cycles = x->cycles;
+  uint64_t budget = max_insns ? max_insns : UINT64_MAX;
+  int ret = 0;
+  x->stop = max_cycles && max_cycles < UINT64_MAX - x->cycles
+              ? x->cycles + max_cycles
+              : UINT64_MAX;
+  ev_deadline(x);
+  e.reason = LIBXTEM_STOP_BUDGET;
+  while (x->bc->insns - start < budget && x->cycles < x->stop) {
+    if (lx_intr(lx)) {
+      e.reason = LIBXTEM_STOP_INTR;
+      break;
+    }
+    if (budget - (x->bc->insns - start) >= RUN_BLOCK_MAX) {
+      ret = block_run(x);
+    } else {
+      ret = step(x);
+    }
+    if (ret < 0) {
+      e.reason = ret == RET_HLT      ? LIBXTEM_STOP_HLT
+                 : ret == RET_BREAK  ? LIBXTEM_STOP_BREAKPOINT
+                 : ret == RET_NOTIMP ? LIBXTEM_STOP_NOTIMP
+                 : ret == RET_IO     ? LIBXTEM_STOP_IO
+                 : ret == RET_WATCH  ? LIBXTEM_STOP_WATCH
+                                     : LIBXTEM_STOP_ERROR;
+      break;
+    }
+  }
+  x->stop = UINT64_MAX;
+  ev_deadline(x);
+  e.pc = (uint32_t)((size_t)CS * 16 + IP);
+  e.insns = x->bc->insns - start;
+  e.cycles = x->cycles - start_cycles;
+  if (e.reason == LIBXTEM_STOP_NOTIMP) {
+    mem_fetch(x, e.opcode, sizeof(e.opcode), e.pc);
+  } else if (e.reason == LIBXTEM_STOP_IO) {
+    e.port = x->io.port;
+    e.value = x->io.value;
+    e.size = x->io.size;
+    e.out = x->io.out;
+  } else if (e.reason == LIBXTEM_STOP_WATCH) {
+    e.watch = x->watch_hit.addr;
+    e.watch_type = x->watch_hit.type;
+    x->watch_hit.type = 0;
+    ev_deadline(x);
+  }
+  return e;
+}
+
+void*
+libxtem_snapshot(void* lx_)
+{
+  lx_t* lx = (lx_t*)lx_;
+  snap_t* s = calloc(1, sizeof(snap_t));
+  if (!s || !(s->ram = malloc(MEM_SIZE))) {
+    free(s);
+    return 0;
+  }
+  xtem_snapshot(lx->x, s);
+  return s;
+}
+
+int
+libxtem_restore(void* lx_, void* snap)
+{
+  lx_t* lx = (lx_t*)lx_;
+  snap_t* s = snap;
+  if (s->x != lx->x) {
+    return -1;
+  }
+  xtem_restore(lx->x, s);
+  return 0;
+}
+
+int
+libxtem_snapshot_free(void* lx_, void* snap)
+{
+  lx_t* lx = (lx_t*)lx_;
+  xtem_t* x = lx->x;
+  snap_t* s = snap;
+  if (s) {
+    if (x->snap == s) {
+      x->snap = 0;
+    }
+    free(s->ram);
+    free(s);
+  }
+  return 0;
+}
+
+int
+libxtem_save(void* lx_, const char* file)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return xtem_save(lx->x, file);
+}
+
+int
+libxtem_load(void* lx_, const char* file)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return xtem_load(lx->x, file);
+}
+
+int
+libxtem_interrupt(void* lx_)
+{
+  lx_t* lx = (lx_t*)lx_;
+  atomic_store_explicit(&lx->intr, 1, memory_order_relaxed);
+  atomic_store_explicit(&lx->rsp.cpu.intr, 1, memory_order_relaxed); // gdb's c
+  return 0;
+}
+
+int
+libxtem_io_exit(void* lx_, int on)
+{
+  lx_t* lx = (lx_t*)lx_;
+  xtem_t* x = lx->x;
+  x->io_exit = on;
+  return 0;
+}
+
+uint64_t
+libxtem_cycles(void* lx_)
+{
+  lx_t* lx = (lx_t*)lx_;
+  xtem_t* x = lx->x;
+  return x->cycles;
+}
+
+int
+libxtem_schedule(void* lx_, uint64_t cycle, libxtem_event_t fn, void* user)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return ev_add(lx->x, cycle, fn, user);
+}
+
+int
+libxtem_unschedule(void* lx_, libxtem_event_t fn, void* user)
+{
+  lx_t* lx = (lx_t*)lx_;
+  ev_cancel(lx->x, fn, user);
+  return 0;
+}
+
+int
+libxtem_dev_add(void* lx_,
+                uint16_t first,
+                uint16_t last,
+                const libxtem_dev_t* dev)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return xtem_dev_add(lx->x, first, last, dev) < 0 ? -1 : 0;
+}
+
+int
+libxtem_trace(void* lx_, int level)
+{
+  lx_t* lx = (lx_t*)lx_;
+  xtem_t* x = lx->x;
+  int prev = x->trace.level;
+#ifndef XTEM_TRACE
+  return -1;
+#endif
+  if (level && !x->trace.ring) {
+    x->trace.ring = calloc(TRACE_RECS, sizeof(trace_rec_t));
+  }
+  x->trace.level = level;
+  return prev;
+}
+
+/* dump file : "XTEMTRC1", record size and count (uint32_t), records */
+int
+libxtem_trace_dump(void* lx_, const char* file)
+{
+  lx_t* lx = (lx_t*)lx_;
+  xtem_t* x = lx->x;
+  uint64_t head, first, wr, skip;
+  trace_rec_t* recs;
+  uint32_t hdr[2];
+  FILE* f;
+  if (!x->trace.ring) {
+    return -1;
+  }
+  head = atomic_load_explicit(&x->trace.head, memory_order_acquire);
+  first = head > TRACE_RECS ? head - TRACE_RECS : 0;
+  recs = malloc((size_t)(head - first) * sizeof(trace_rec_t));
+  for (uint64_t i = first; i < head; i++) {
+    recs[i - first] = x->trace.ring[i & (TRACE_RECS - 1)];
+  }
+  /* skip what got overwritten while copying : up to the record being
+     written, whose slot is the one of record wr - TRACE_RECS */
+  atomic_thread_fence(memory_order_acquire);
+  wr = atomic_load_explicit(&x->trace.wr, memory_order_relaxed);
+  skip = wr >= first + TRACE_RECS ? wr + 1 - first - TRACE_RECS : 0;
+  if (skip > head - first) {
+    skip = head - first;
+  }
+  f = fopen(file, "wb");
+  if (!f) {
+    perror(file);
+    free(recs);
+    return -1;
   }
+  hdr[0] = sizeof(trace_rec_t);
+  hdr[1] = (uint32_t)(head - first - skip);
+  fwrite("XTEMTRC1", 8, 1, f);
+  fwrite(hdr, sizeof(hdr), 1, f);
+  fwrite(recs + skip, sizeof(trace_rec_t), hdr[1], f);
+  fclose(f);
+  free(recs);
   return 0;
 }
 
+int
+libxtem_breakpoint(void* lx_, uint32_t addr, int on)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return xtem_bp(lx->x, addr, on);
+}
+
+int
+libxtem_watchpoint(void* lx_, uint32_t addr, uint32_t len, int type, int on)
+{
+  lx_t* lx = (lx_t*)lx_;
+  if (type < LIBXTEM_WATCH_WRITE || type > LIBXTEM_WATCH_ACCESS) {
+    return -1;
+  }
+  return xtem_watch(lx->x, addr, len, type, on);
+}
+
+int
+libxtem_prof(void* lx_, int on)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return prof_enable(lx->x, on);
+}
+
+int
+libxtem_prof_dump(void* lx_, const char* file)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return prof_dump(lx->x, file);
+}
+
+int
+libxtem_monitor(void* lx_, const char* cmd, char* out, size_t len)
+{
+  lx_t* lx = (lx_t*)lx_;
+  return xtem_monitor(lx->x, cmd, out, len);
+}
+
 int
 libxtem_execute(void* lx_)
 {
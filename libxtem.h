@@ -2,28 +2,238 @@
 #define libxtem_h
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
-/* Flaky RSP API */
+/* Flaky RSP API
+   s and c run the guest on a CPU thread and return at once, <0 if it's
+   already running; memory reads and read-only monitor commands can be served
+   meanwhile, the other calls fail until the stop reply is read */
 
 void*
 xtem_rsp_init();
 int
 xtem_rsp_s(void* r);
 int
+xtem_rsp_c(void* r);
+// stop the running c, as gdb's ^C
+int
+xtem_rsp_intr(void* r);
+// readable while the stop reply is queued, to select() on
+int
+xtem_rsp_fd(void* r);
+int
 xtem_rsp_g(void* r, char* data);
 int
-xtem_rsp_m(void* r, char* data, size_t len, size_t addr);
+xtem_rsp_m(void* r, char* data, size_t addr, size_t len);
+// register and memory writes, <0 on malformed data or unknown registers
+int
+xtem_rsp_G(void* r, const char* data);
+int
+xtem_rsp_p(void* r, char* data, int n);
+int
+xtem_rsp_P(void* r, int n, const char* data);
+int
+xtem_rsp_M(void* r, const char* data, size_t addr, size_t len);
+// binary memory read and write, for the x and X packets
+int
+xtem_rsp_x(void* r, uint8_t* data, size_t addr, size_t len);
+int
+xtem_rsp_X(void* r, const uint8_t* data, size_t addr, size_t len);
+// Z0 to Z4 and z0 to z4, return : -2 for the other types
+int
+xtem_rsp_Z(void* r, int type, size_t addr, size_t kind, int on);
+// S05, or T05 and the watchpoint hit, waiting for the CPU thread to stop
+int
+xtem_rsp_stop(void* r, char* data, size_t len);
+// qXfer:memory-map:read XML, return : its length
+int
+xtem_rsp_map(void* r, char* xml, size_t len);
+// qRcmd, see libxtem_monitor()
+int
+xtem_rsp_monitor(void* r, const char* cmd, char* out, size_t len);
 int
 xtem_rsp_cleanup(void* r);
 
-/* XTEM API */
+/* XTEM API
+   the library has no global mutable state : distinct handles from
+   libxtem_init() can be driven concurrently from different threads, with
+   no locking on the execution path. A given handle must only be used by one
+   thread at a time, except for libxtem_interrupt() and libxtem_trace_dump(),
+   which can be called while another thread runs it. With an RSP port, gdb's
+   c runs on a thread of the handle's own. */
+typedef struct
+{
+  const char* file; // 0 => end of the list
+  size_t addr;      // guest address, 0 => system BIOS, ending at 0xFFFFF
+} libxtem_rom_t;
+
+void*
+libxtem_init(int rsp_port); // with the bundled bios64
+// return : 0 if a ROM image couldn't be mapped
 void*
-libxtem_init(int rsp_port);
+libxtem_init_roms(int rsp_port, const libxtem_rom_t* roms);
 int
 libxtem_execute(void* x);
 int
 libxtem_cleanup(void* x);
 
+typedef struct
+{
+  uint64_t bc_hits;          // decoded block cache lookups that hit
+  uint64_t bc_misses;        // blocks decoded
+  uint64_t bc_invalidations; // blocks dropped by writes to their pages
+  uint64_t insns;            // instructions executed
+  uint64_t cycles;           // 8088 clocks, approximately
+  uint64_t idle_cycles;      // of which skipped, halted or busy-waiting
+  uint64_t jit_blocks;       // blocks translated (XTEM_JIT)
+  uint64_t jit_flushes;      // translation buffer flushes (XTEM_JIT)
+} libxtem_stats_t;
+int
+libxtem_stats(void* x, libxtem_stats_t* stats);
+
+/* batched execution */
+enum
+{
+  LIBXTEM_STOP_BUDGET,     // max_insns or max_cycles reached
+  LIBXTEM_STOP_HLT,        // pc is after a HLT nothing can end (IF clear...)
+  LIBXTEM_STOP_BREAKPOINT, // pc is on the INT 3 or breakpoint, resuming runs it
+  LIBXTEM_STOP_NOTIMP,     // unimplemented opcode at pc
+  LIBXTEM_STOP_IO,         // port access, with libxtem_io_exit()
+  LIBXTEM_STOP_INTR,       // libxtem_interrupt() or RSP interrupt
+  LIBXTEM_STOP_ERROR,
+  LIBXTEM_STOP_WATCH,      // pc is after an access to a watchpoint
+};
+
+typedef struct
+{
+  int reason;         // LIBXTEM_STOP_*
+  uint32_t pc;        // linear address of the next instruction
+  uint64_t insns;     // executed by this run
+  uint64_t cycles;    // executed by this run, see libxtem_cycles()
+  uint8_t opcode[6];  // LIBXTEM_STOP_NOTIMP : instruction bytes at pc
+  uint16_t port;      // LIBXTEM_STOP_IO : the port access
+  uint16_t value;
+  uint8_t size;
+  uint8_t out;
+  uint32_t watch;     // LIBXTEM_STOP_WATCH : the address accessed
+  int watch_type;     // and the LIBXTEM_WATCH_* of its watchpoint
+} libxtem_exit_t;
+
+/* run up to max_insns instructions or max_cycles cycles (0 => unlimited)
+   without returning to the caller, see LIBXTEM_STOP_* for the other
+   reasons to stop; the instruction reaching max_cycles completes */
+libxtem_exit_t
+libxtem_run(void* x, uint64_t max_insns, uint64_t max_cycles);
+// request the current or next libxtem_run() to stop
+int
+libxtem_interrupt(void* x);
+// make accesses to unclaimed ports stop libxtem_run(), after the instruction
+int
+libxtem_io_exit(void* x, int on);
+
+/* set (on) or clear the breakpoint at linear address addr, runs stop
+   before it, or run it when resumed there; they cost nothing outside of
+   the pages they are on
+   return : <0 if out of range or too many are set */
+int
+libxtem_breakpoint(void* x, uint32_t addr, int on);
+
+/* set or clear a watchpoint on len bytes at linear address addr : the
+   guest accesses of type there stop runs after the instruction; they cost
+   nothing outside of the pages they are on
+   return : <0 if out of range or too many are set */
+enum
+{
+  LIBXTEM_WATCH_WRITE = 1,
+  LIBXTEM_WATCH_READ,
+  LIBXTEM_WATCH_ACCESS,
+};
+int
+libxtem_watchpoint(void* x, uint32_t addr, uint32_t len, int type, int on);
+
+/* timed devices
+   the CPU counts 8088 clocks, and calls fn with user and the current count
+   once it reached the cycle given to libxtem_schedule(), between
+   instructions; a fn and user pair has at most one pending event */
+typedef void (*libxtem_event_t)(void* user, uint64_t now);
+uint64_t
+libxtem_cycles(void* x);
+// return : <0 if there are too many pending events
+int
+libxtem_schedule(void* x, uint64_t cycle, libxtem_event_t fn, void* user);
+int
+libxtem_unschedule(void* x, libxtem_event_t fn, void* user);
+
+/* port I/O devices
+   in and out are called with the user pointer, for size 1 or 2 accesses,
+   word ones being split in two byte ones unless word is set; a 0 in reads
+   all ones, a 0 out ignores writes */
+typedef struct
+{
+  const char* name;
+  void* user;
+  uint16_t (*in)(void* user, uint16_t port, int size);
+  void (*out)(void* user, uint16_t port, uint16_t value, int size);
+  int word;
+} libxtem_dev_t;
+/* claim ports first to last, over devices added before
+   return : <0 if there are too many devices */
+int
+libxtem_dev_add(void* x,
+                uint16_t first,
+                uint16_t last,
+                const libxtem_dev_t* dev);
+
+/* snapshots of the CPU, PIC and PIT state and RAM, for fast resets
+   restoring the snapshot last taken or restored only copies back the pages
+   written since; snapshots belong to the handle that took them */
+// return : 0 on allocation failure
+void*
+libxtem_snapshot(void* x);
+int
+libxtem_restore(void* x, void* snap);
+int
+libxtem_snapshot_free(void* x, void* snap);
+
+/* save-state files, with the CPU, PIC and PIT state and the non zero RAM
+   pages; loading maps the pages from the file, they are only read when
+   touched; the ROMs are the ones x was initialized with */
+int
+libxtem_save(void* x, const char* file);
+int
+libxtem_load(void* x, const char* file);
+
+/* execution trace, when built with TRACE=1 (default)
+   each level also records what the previous ones do */
+enum
+{
+  LIBXTEM_TRACE_OFF,
+  LIBXTEM_TRACE_INSN, // PC, instruction bytes, port output
+  LIBXTEM_TRACE_REGS, // register changes
+  LIBXTEM_TRACE_MEM,  // memory operands
+};
+// return : previous level, <0 if tracing isn't built in
+int
+libxtem_trace(void* x, int level);
+/* write the records in the trace ring, oldest first, for trace.py
+   can be called while another thread runs x */
+int
+libxtem_trace_dump(void* x, const char* file);
+
+/* hot-spot profiler, when built with PROF=1
+   counts the instructions run per PC, opcode and calling context, see
+   libxtem_monitor() "prof" commands (gdb's monitor), off by default */
+// return : previous state, <0 if profiling isn't built in
+int
+libxtem_prof(void* x, int on);
+// write the calling contexts as folded stacks, for flamegraph.pl
+int
+libxtem_prof_dump(void* x, const char* file);
+/* run a gdb monitor command, as over RSP, its text output in out
+   return : <0 for unknown commands or errors */
+int
+libxtem_monitor(void* x, const char* cmd, char* out, size_t len);
+
 #endif /*libxtem_h*/
@@ -7,79 +7,167 @@ lib=ctypes.cdll.LoadLibrary("./libxtem.so")
 lib.xtem_rsp_init.restype = ctypes.c_void_p
 lib.xtem_rsp_s.argtypes = (ctypes.c_void_p,)
 lib.xtem_rsp_c.argtypes = (ctypes.c_void_p,)
+lib.xtem_rsp_intr.argtypes = (ctypes.c_void_p,)
+lib.xtem_rsp_fd.argtypes = (ctypes.c_void_p,)
 lib.xtem_rsp_g.argtypes = (ctypes.c_void_p,ctypes.c_char_p)
-lib.xtem_rsp_m.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_int,ctypes.c_int)
+lib.xtem_rsp_m.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_size_t,ctypes.c_size_t)
+lib.xtem_rsp_G.argtypes = (ctypes.c_void_p,ctypes.c_char_p)
+lib.xtem_rsp_p.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_int)
+lib.xtem_rsp_P.argtypes = (ctypes.c_void_p,ctypes.c_int,ctypes.c_char_p)
+lib.xtem_rsp_M.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_size_t,ctypes.c_size_t)
+lib.xtem_rsp_Z.argtypes = (ctypes.c_void_p,ctypes.c_int,ctypes.c_size_t,ctypes.c_size_t,ctypes.c_int)
+lib.xtem_rsp_stop.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_size_t)
+lib.xtem_rsp_x.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_size_t,ctypes.c_size_t)
+lib.xtem_rsp_X.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_size_t,ctypes.c_size_t)
+lib.xtem_rsp_map.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_size_t)
+lib.xtem_rsp_monitor.argtypes = (ctypes.c_void_p,ctypes.c_char_p,ctypes.c_char_p,ctypes.c_size_t)
 rsp=lib.xtem_rsp_init()
 print("rsp=%x" % rsp)
 
+import re
+PACKET_SIZE=0x4000		# advertised in qSupported
+buf=ctypes.create_string_buffer(PACKET_SIZE)	# memory reads, reused
+def getbuf(n):
+	global buf
+	if n>len(buf):
+		buf=ctypes.create_string_buffer(n)
+	return buf
+def escape(data):		# binary data : #, $, * and } as } and the byte xor 0x20
+	return re.sub(rb'[#$*}]',lambda m:b'}'+bytes([m.group()[0]^0x20]),data)
+def unescape(data):
+	return re.sub(rb'}(.)',lambda m:bytes([m.group(1)[0]^0x20]),data,flags=re.S)
+memory_map=None
+noack=False		# after QStartNoAckMode
+stopfd=lib.xtem_rsp_fd(rsp)	# readable once c stopped, its reply to send
+
+import select
 import socket
 ss=socket.socket(socket.AF_INET,socket.SOCK_STREAM)
 ss.setsockopt(socket.SOL_SOCKET,socket.SO_REUSEADDR,1)
 port=1235;ss.bind(("",port));ss.listen(1);print("accepting on port %d.."%port)
 s,addr=ss.accept();print("receiving from %s.."%str(addr))
 while True:
-	a=s.recv(1).decode()
-	if a=='+':
+	rd,_,_=select.select([s,stopfd],[],[])
+	if stopfd in rd:		# the guest stopped, for c or ^C
+		data=getbuf(64)
+		l=lib.xtem_rsp_stop(rsp, data, 64)
+		r=data.raw[:l]
+		s.sendall(b"$"+r+b"#%02x"%(sum(r)&0xff))
+		continue
+	a=s.recv(1)
+	if a==b'+':
 		continue
-	if a=='$':			# begin sync cmd, terminated by #xy
-		c=""
+	if a==b'$':			# begin sync cmd, terminated by #xy
+		c=b""
 		while True:
-			c+=s.recv(1024).decode()
-			d=c.find('#')
+			c+=s.recv(1024)
+			d=c.find(b'#')		# escaped in binary data
 			if d!=-1:
 				if len(c)<d+2:
-					c+=s.recv(2).decode()
+					c+=s.recv(2)
 				break
 		#print("received sync cmd %s"%c)
-		s.send('+'.encode())		# ack
-		r=""		# default reply is "$", N/A
+		if not noack:
+			s.send(b'+')		# ack
+		c=c[:d]
+		r=b""		# default reply is "$", N/A
 		csum=0
-		if c[0]=='?':			# get program status
+		if c[:1]==b'?':			# get program status
 			#s.sendall("$O4142430D0A#66")
-			r+="S05"
+			r+=b"S05"
 #			r+="T05thread:01;"
 			#r+="O4142430D0A"
 			#r+="OABCDEFGHIJK"
-		elif c[0]=='k':			# kill
+		elif c[:1]==b'k':			# kill
 			break
-		elif c[0]=='s':			# step instruction
+		elif c[:1]==b's':			# step instruction
 			res=lib.xtem_rsp_s(rsp)
 			#print("res=%d" % res)
-			r+="S05"
+			if res<0:
+				r+=b"E01"
+			else:
+				data=getbuf(64)
+				l=lib.xtem_rsp_stop(rsp, data, 64)
+				r+=data.raw[:l]
 #			r+="T05thread:01;"
-		elif c[0]=='c':			# continue execution
+		elif c[:1]==b'c':			# continue execution, replied once stopped
 			res=lib.xtem_rsp_c(rsp)
 			#print("res=%d" % res)
-			r+="S05"
+			if res>=0:
+				continue
+			r+=b"E01"
 			#r+="O414243440D0A"
-		elif c[0]=='g':			# get registers
+		elif c[:1]==b'g':			# get registers
 			data="0"*(8*16+560)
 			data = data.encode()
 			#print("before=%s" % data)
 			res=lib.xtem_rsp_g(rsp, data)
-			data = data.decode()
 			#print("after=%s" % data)
-			r+=data
-		elif c[0]=='m':			# read memory
+			r+=data if res>=0 else b"E01"
+		elif c[:1]==b'G':			# set registers
+			res=lib.xtem_rsp_G(rsp, c[1:])
+			r+=b"OK" if res>=0 else b"E01"
+		elif c[:1]==b'p':			# get register, empty if unknown : gdb uses g
+			data=getbuf(8)
+			res=lib.xtem_rsp_p(rsp, data, int(c[1:],16))
+			if res>=0:
+				r+=data.raw[:8]
+			elif res==-2:
+				r+=b"E01"
+		elif c[:1]==b'P':			# set register
+			n,v=c[1:].split(b'=')
+			res=lib.xtem_rsp_P(rsp, int(n,16), v)
+			r+=b"OK" if res>=0 else b"E01"
+		elif c[:1]==b'M':			# write memory
+			a,data=c[1:].split(b':',1)
+			a,l=[int(v,16) for v in a.split(b',')]
+			res=lib.xtem_rsp_M(rsp, data, a, l)
+			r+=b"OK" if res>=0 else b"E01"
+		elif c[:1] in (b'Z',b'z'):		# set or clear a break or watchpoint
+			t,a,k=[int(v,16) for v in c[1:].split(b';')[0].split(b',')]
+			res=lib.xtem_rsp_Z(rsp, t, a, k, c[:1]==b'Z')
+			if res!=-2:			# unsupported type : empty reply
+				r+=b"OK" if res>=0 else b"E01"
+		elif c[:1]==b'm':			# read memory
 			#print("m command : [%s]" % c)
-			a,l=c.split('m')[1].split("#")[0].split(',')
-			a=int('0x' + a,0)
-			l=int('0x' + l,0)
+			a,l=[int(v,16) for v in c[1:].split(b',')]
 			#print("a=%x l=%x" % (a, l))
-			data="0"*2*l
-			data = data.encode()
-			#print("before=%s" % data)
-			res=lib.xtem_rsp_m(rsp, data, ctypes.c_int(a), ctypes.c_int(l))
-			data = data.decode()
-			#print("after=%s" % data)
-			r+=data
-		for c in r:
-			csum+=ord(c)
-		csum&=0xff
+			data=getbuf(2*l)
+			res=lib.xtem_rsp_m(rsp, data, a, l)
+			r+=data.raw[:2*l]
+		elif c[:1]==b'x':			# read memory, binary
+			a,l=[int(v,16) for v in c[1:].split(b',')]
+			data=getbuf(l)
+			res=lib.xtem_rsp_x(rsp, data, a, l)
+			r+=b'b'+escape(data.raw[:l])
+		elif c[:1]==b'X':			# write memory, binary
+			a,data=unescape(c[1:]).split(b':',1)
+			a,l=[int(v,16) for v in a.split(b',')]
+			res=lib.xtem_rsp_X(rsp, data, a, l)
+			r+=b"OK" if res>=0 else b"E01"
+		elif c.startswith(b'qSupported'):
+			r+=b"PacketSize=%x;qXfer:memory-map:read+;QStartNoAckMode+"%PACKET_SIZE
+		elif c.startswith(b'qRcmd,'):		# monitor, hex encoded both ways
+			data=getbuf(2048)
+			res=lib.xtem_rsp_monitor(rsp, bytes.fromhex(c[6:].decode()), data, 2048)
+			r+=data.value.hex().encode() if data.value else b"OK"
+		elif c==b'QStartNoAckMode':	# acked, then no more acks both ways
+			noack=True
+			r+=b"OK"
+		elif c.startswith(b'qXfer:memory-map:read::'):
+			if not memory_map:
+				data=getbuf(4096)
+				l=lib.xtem_rsp_map(rsp, data, len(data))
+				memory_map=data.raw[:l]
+			o,l=[int(v,16) for v in c[23:].split(b',')]
+			r+=(b'm' if o+l<len(memory_map) else b'l')+escape(memory_map[o:o+l])
+		csum=sum(r)&0xff
 		#print("reply=%s csum=%02x"%(r,csum))
-		r="$"+r+"#%02x"%csum
-		s.sendall(r.encode())
-	elif a=="":
+		r=b"$"+r+b"#%02x"%csum
+		s.sendall(r)
+	elif a==b'\x03':			# ^C, the stop reply follows
+		lib.xtem_rsp_intr(rsp)
+	elif a==b"":
 		print("client left")
 		break
 	else:
@@ -0,0 +1,13 @@
+#!/bin/sh
+
+# compare the interpreter cores, without and with the JIT, on the benchmarks
+# of bench.c, results in bench-<core>-jit<0|1>.json
+# usage : ./run_bench.sh [scale]
+
+n=${1:-1}
+for jit in 0 1; do
+	for core in switch threaded; do
+		make -s clean && make -s OPT=2 TRACE=0 CORE=$core JIT=$jit xtem_bench || exit 1
+		./xtem_bench $n bench-$core-jit$jit.json > /dev/null || exit 1
+	done
+done
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Decode an xtem trace dump (see libxtem_trace_dump()) to text
+# usage : trace.py [xtem.trace [8086_table.txt]]
+
+import struct
+import sys
+
+import gen_table
+
+TR_INSN, TR_REG, TR_MEMR, TR_MEMW, TR_OUT, TR_IN = range(6)
+REC = struct.Struct("<BBHI8s")
+REGS = ["AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI", "ES", "CS", "SS", "DS",
+	"FL"]
+# same as hint_out() in libxtem.c
+HINTS = [(0x0000, 0x001F, "first legacy DMA controller, floppies"),
+	(0x0020, 0x0021, "first Programmable Interrupt Controller"),
+	(0x0022, 0x0023, "Model-Specific Registers of Cyrix processors"),
+	(0x0040, 0x0047, "PIT (Programmable Interval Timer)"),
+	(0x0060, 0x0064, "'8042' PS/2 Controller, keyboards and mice"),
+	(0x0070, 0x0071, "CMOS and RTC registers"),
+	(0x0080, 0x008F, "DMA (Page registers)"),
+	(0x0092, 0x0092, "fast A20 gate register"),
+	(0x00A0, 0x00A1, "second PIC"),
+	(0x00C0, 0x00DF, "second DMA controller, soundblasters"),
+	(0x00E9, 0x00E9, "Port E9 Hack"),
+	(0x0170, 0x0177, "secondary ATA harddisk controller"),
+	(0x01F0, 0x01F7, "primary ATA harddisk controller"),
+	(0x0278, 0x027A, "Parallel port"),
+	(0x02F8, 0x02FF, "Second serial port"),
+	(0x03B0, 0x03DF, "VGA"),
+	(0x03F0, 0x03F7, "Floppy disk controller"),
+	(0x03F8, 0x03FF, "First serial port")]
+
+def hint(port):
+	for first, last, h in HINTS:
+		if first <= port <= last:
+			return h
+	return "???"
+
+def insn(opcodes, groups, b):
+	f = opcodes.get(b[0], ["--"])
+	mn, forms = f[0], f[1:]
+	modrm = any(o in gen_table.MODRM for o in forms)
+	if mn in groups:
+		sub = groups[mn].get((b[1] >> 3) & 7, ["--"])
+		mn = "%s\t%02x : %s" % (mn, b[1], sub[0])
+		forms = sub[1:] or forms
+		modrm = True
+	pos = 1
+	if modrm:
+		mod, rm = b[1] >> 6, b[1] & 7
+		pos += 1 + (2 if mod == 0 and rm == 6 else [0, 1, 2, 0][mod])
+	ops = []
+	for o in forms:
+		n = gen_table.IMM.get(o, 0)
+		v = int.from_bytes(b[pos:pos + n], "little")
+		if n == 4:
+			ops.append("%s=%04x:%04x" % (o, v >> 16, v & 0xffff))
+		elif n:
+			ops.append("%s=%0*x" % (o, 2 * n, v))
+		else:
+			ops.append(o)
+		pos += n
+	return "%s\t\t%s" % (mn, "\t".join(ops)) if ops else mn
+
+def main(fname, table):
+	opcodes, groups = gen_table.parse(table)
+	data = open(fname, "rb").read()
+	if data[:8] != b"XTEMTRC1":
+		sys.exit("%s: not an xtem trace" % fname)
+	size, count = struct.unpack_from("<II", data, 8)
+	for i in range(count):
+		t, n, v, addr, b = REC.unpack_from(data, 16 + i * size)
+		if t == TR_INSN:
+			print("%05x %s" % (addr, insn(opcodes, groups, b)))
+		elif t == TR_REG and 8 <= n <= 11:
+			print("SETTING %s=%04x" % (REGS[n], v))
+		elif t == TR_REG:
+			print("\t%s=%04x\t(%04x)" % (REGS[n], v, addr))
+		elif t == TR_MEMR:
+			print("\t[%05x] => %0*x" % (addr, 2 * n, v))
+		elif t == TR_MEMW:
+			print("\t[%05x] <= %d bytes" % (addr, n))
+		elif t == TR_OUT:
+			print("OUT %04x %s=%0*x\t[%s]" % (addr, "AX" if n == 2 else "AL",
+				2 * n, v, hint(addr)))
+		elif t == TR_IN:
+			print("IN %04x %s=%0*x\t[%s]" % (addr, "AX" if n == 2 else "AL",
+				2 * n, v, hint(addr)))
+
+if __name__ == "__main__":
+	main(sys.argv[1] if len(sys.argv) > 1 else "xtem.trace",
+		sys.argv[2] if len(sys.argv) > 2 else "8086_table.txt")
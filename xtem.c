@@ -1,18 +1,53 @@
 #include "libxtem.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#define ROMS_MAX 8
+
+// usage : xtem [port [rom_file[@hex_addr]]...]
+// XTEM_TRACE=level in the environment traces to xtem.trace, see trace.py
+// XTEM_STATE=file in the environment resumes from a libxtem_save() file
+// XTEM_PROF=file in the environment profiles to file, as folded stacks
 int
 main(int argc, char* argv[])
 {
   int arg = 1;
   int port = 1235;
+  libxtem_rom_t roms[ROMS_MAX + 1] = { { 0 } };
+  int nroms = 0;
   if (arg < argc) {
     sscanf(argv[arg++], "%d", &port);
   }
-  void* x = libxtem_init(port);
+  while (arg < argc && nroms < ROMS_MAX) {
+    char* at = strchr(argv[arg], '@');
+    if (at) {
+      *at++ = 0;
+      sscanf(at, "%zx", &roms[nroms].addr);
+    }
+    roms[nroms++].file = argv[arg++];
+  }
+  void* x = libxtem_init_roms(port, nroms ? roms : 0);
+  if (!x)
+    return 1;
+  char* state = getenv("XTEM_STATE");
+  if (state && libxtem_load(x, state) < 0) {
+    libxtem_cleanup(x);
+    return 1;
+  }
+  char* trace = getenv("XTEM_TRACE");
+  if (trace)
+    libxtem_trace(x, atoi(trace));
+  char* prof = getenv("XTEM_PROF");
+  if (prof)
+    libxtem_prof(x, 1);
   while (1) {
     int n = libxtem_execute(x);
     printf("%s: n=%d\n", __func__, n);
+    if (trace)
+      libxtem_trace_dump(x, "xtem.trace");
+    if (prof)
+      libxtem_prof_dump(x, prof);
     if (n < 0)
       break;
   }